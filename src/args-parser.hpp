@@ -1,15 +1,113 @@
+#pragma once
+#include <string_view>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
 #include "args.hpp"
+#include "macros/assert.hpp"
 #include "util/argument-parser.hpp"
+#include "util/split.hpp"
+
+template <class... Args>
+auto setup_encoder_args(CommonArgs& args, args::Parser<Args...>& parser) -> void {
+    parser.kwarg(&args.enc_bitrate_mode, {"--enc-bitrate-mode"}, "{cbr|vbr|cq}", "v4l2 encoder rate control", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.encoder_config.bitrate, {"--enc-bitrate"}, "BPS", "v4l2 encoder bitrate, 0 = 200k per fps", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.encoder_config.quality, {"--enc-quality"}, "1..100", "v4l2 encoder quality in cq mode", {.state = args::State::Initialized});
+    parser.kwarg(&args.encoder_config.qp_min, {"--enc-qp-min"}, "QP", "v4l2 encoder minimum qp", {.state = args::State::Initialized});
+    parser.kwarg(&args.encoder_config.qp_max, {"--enc-qp-max"}, "QP", "v4l2 encoder maximum qp", {.state = args::State::Initialized});
+    parser.kwarg(&args.encoder_config.gop, {"--enc-gop"}, "FRAMES", "frames between keyframes, 0 = one second", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.encoder_config.b_frames, {"--enc-b-frames"}, "N", "b-frames between p-frames", {.state = args::State::Initialized});
+    parser.kwarg(&args.encoder_config.slice_mbs, {"--enc-slice-mbs"}, "N", "macroblocks per slice, 0 = one slice per frame", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.enc_profile, {"--enc-profile"}, "{baseline|constrained-baseline|main|high}", "h.264 profile", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.enc_level, {"--enc-level"}, "LEVEL", "h.264 level, 1.0 to 5.1", {.state = args::State::Initialized});
+}
+
+template <class... Args>
+auto setup_recording_args(CommonArgs& args, args::Parser<Args...>& parser) -> void {
+    parser.kwarg(&args.segment_seconds, {"--segment-seconds"}, "SECONDS", "start a new file at the first keyframe after this long", {.state = args::State::Initialized});
+    parser.kwarg(&args.segment_mbytes, {"--segment-size"}, "MIB", "start a new file at the first keyframe after this size", {.state = args::State::Initialized});
+    parser.kwarg(&args.segment_keep, {"--segment-keep"}, "MINUTES", "delete the segments older than this", {.state = args::State::Initialized});
+    parser.kwflag(&args.fragmented, {"--fragmented"}, "write fragmented mp4 or short matroska clusters, a crash only loses the last second");
+    parser.kwarg(&args.preroll, {"--preroll"}, "SECONDS", "keep encoding while idle, recordings start this far back", {.state = args::State::Initialized});
+    parser.kwarg(&args.preroll_mbytes, {"--preroll-size"}, "MIB", "memory bound of the pre-roll", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.raw_buffer_mbytes, {"--raw-buffer"}, "MIB", "memory for raw frames waiting to be written, frames over it are dropped", {.state = args::State::DefaultValue});
+}
+
+template <class... Args>
+auto setup_internal_encoder_args(CommonArgs& args, args::Parser<Args...>& parser) -> void {
+    parser.kwarg(&args.video_preset, {"--video-preset"}, "PRESET", "encoder preset, e.g. veryfast for libx264", {.state = args::State::Initialized});
+    parser.kwarg(&args.video_tune, {"--video-tune"}, "TUNE", "encoder tune, e.g. zerolatency for libx264", {.state = args::State::Initialized});
+    parser.kwarg(&args.video_crf, {"--video-crf"}, "CRF", "constant rate factor", {.state = args::State::Initialized});
+    parser.kwarg(&args.video_threads, {"--video-threads"}, "N", "encoder threads, 0 = auto", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.video_thread_type, {"--video-thread-type"}, "{auto|frame|slice}", "encoder threading", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.video_b_frames, {"--video-b-frames"}, "N", "b-frames between p-frames", {.state = args::State::Initialized});
+    parser.kwarg(&args.video_lookahead, {"--video-lookahead"}, "FRAMES", "rate control lookahead", {.state = args::State::Initialized});
+    parser.kwarg(&args.video_codec_options, {"--video-codec-options"}, "KEY=VALUE,...", "extra codec options, override the above", {.state = args::State::Initialized});
+}
 
 template <class... Args>
 auto setup_common_args(CommonArgs& args, args::Parser<Args...>& parser) -> void {
     parser.kwarg(&args.savedir, {"-o", "--output"}, "PATH", "output directory", {.state = args::State::DefaultValue});
     parser.kwarg(&args.width, {"--width"}, "WIDTH", "horizontal resolution", {.state = args::State::DefaultValue});
     parser.kwarg(&args.height, {"--height"}, "HEIGHT", "vertical resolution", {.state = args::State::DefaultValue});
-    parser.kwarg(&args.video_codec, {"--video-codec"}, "CODEC", "video codec for recording(see ffmpeg -codecs)", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.burst, {"--burst"}, "N", "photos taken from consecutive frames per press, 0 = while held", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.burst_mbytes, {"--burst-size"}, "MIB", "memory for photos waiting to be saved, frames over it are dropped", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.video_codec, {"--video-codec"}, "CODEC", "video codec for recording(see ffmpeg -codecs), v4l2-{h264|hevc|vp8|vp9}, copy for mjpeg cameras, or raw", {.state = args::State::DefaultValue});
     parser.kwarg(&args.audio_codec, {"--audio-codec"}, "CODEC", "audio codec for recording(see ffmpeg -codecs)", {.state = args::State::DefaultValue});
     parser.kwarg(&args.video_filter, {"--video-filter"}, "FILTER", "video filter", {.state = args::State::Initialized});
     parser.kwarg(&args.audio_sample_rate, {"--audio-sample-rate"}, "NUM", "audio sampling rate", {.state = args::State::DefaultValue});
+    setup_recording_args(args, parser);
+    setup_internal_encoder_args(args, parser);
+    setup_encoder_args(args, parser);
     parser.kwflag(&args.ffmpeg_debug, {"--ffmpeg-debug"}, "enable ffmpeg debug outputs");
     parser.kwflag(&args.help, {"-h", "--help"}, "print this help message", {.no_error_check = true});
 }
+
+// resolves the string options after parsing
+inline auto resolve_common_args(CommonArgs& args) -> bool {
+    constexpr auto v4l2_prefix = std::string_view("v4l2-");
+    if(const auto codec = std::string_view(args.video_codec); codec.starts_with(v4l2_prefix)) {
+        const auto v4l2_codec = ff::parse_v4l2_codec(codec.substr(v4l2_prefix.size()));
+        ensure(v4l2_codec, "unknown v4l2 codec {}", codec);
+        ensure(*v4l2_codec != ff::V4L2Codec::FWHT, "fwht cannot be recorded");
+        args.encoder_config.codec = *v4l2_codec;
+        args.use_v4l2_encoder     = true;
+    }
+    args.copy_video = std::string_view(args.video_codec) == "copy";
+    args.raw_video  = std::string_view(args.video_codec) == "raw";
+
+    ensure(args.burst >= 0, "--burst must not be negative");
+    ensure(!args.raw_video || (args.preroll == 0 && args.segment_seconds == 0 && args.segment_mbytes == 0), "--video-codec raw cannot be segmented or pre-rolled");
+    ensure(args.segment_keep == 0 || args.segment_seconds > 0 || args.segment_mbytes > 0, "--segment-keep needs --segment-seconds or --segment-size");
+
+    if(const auto type = std::string_view(args.video_thread_type); type == "frame") {
+        args.codec_thread_type = FF_THREAD_FRAME;
+    } else if(type == "slice") {
+        args.codec_thread_type = FF_THREAD_SLICE;
+    } else {
+        ensure(type == "auto", "unknown thread type {}", type);
+    }
+    if(args.video_codec_options[0] != '\0') {
+        for(const auto elm : split(args.video_codec_options, ",")) {
+            const auto pair = split(elm, "=");
+            ensure(pair.size() == 2, "malformed codec option {}", elm);
+            args.codec_options.push_back({std::string(pair[0]), std::string(pair[1])});
+        }
+    }
+
+    const auto bitrate_mode = ff::parse_bitrate_mode(args.enc_bitrate_mode);
+    ensure(bitrate_mode, "unknown bitrate mode {}", args.enc_bitrate_mode);
+    args.encoder_config.bitrate_mode = *bitrate_mode;
+
+    const auto profile = ff::parse_h264_profile(args.enc_profile);
+    ensure(profile, "unknown profile {}", args.enc_profile);
+    args.encoder_config.profile = *profile;
+    if(args.enc_level[0] != '\0') {
+        const auto level = ff::parse_h264_level(args.enc_level);
+        ensure(level, "unknown level {}", args.enc_level);
+        args.encoder_config.level = *level;
+    }
+    return true;
+}
@@ -1,16 +1,63 @@
 #pragma once
+#include <array>
+#include <string>
+#include <vector>
+
+#include "v4l2-encoder/config.hpp"
 
 struct CommonArgs {
     const char* savedir = ".";
     int         width   = 1280;
     int         height  = 720;
 
+    // photos
+    int burst        = 1;   // per press, 0 = while held
+    int burst_mbytes = 256; // waiting to be saved
+
     // recoding
-    const char* video_codec       = "libx264";
+    const char* video_codec       = "libx264"; // "v4l2-<codec>" selects the v4l2 encoder, "copy" muxes the camera's mjpeg, "raw" dumps the buffers
     const char* audio_codec       = "aac";
     const char* video_filter      = "";
     int         audio_sample_rate = 48000;
 
+    // segmented recording
+    int  segment_seconds = 0;
+    int  segment_mbytes  = 0;
+    int  segment_keep    = 0; // minutes
+    bool fragmented      = false;
+
+    // always-on encoding, recordings start with the last seconds
+    int preroll        = 0; // seconds
+    int preroll_mbytes = 64;
+
+    // internal encoder, negative numbers and empty strings are picked from the core count and frame rate
+    const char* video_preset        = "";
+    const char* video_tune          = "";
+    int         video_crf           = -1;
+    int         video_threads       = 0;
+    const char* video_thread_type   = "auto";
+    int         video_b_frames      = -1;
+    int         video_lookahead     = -1;
+    const char* video_codec_options = "";
+
+    std::vector<std::array<std::string, 2>> codec_options;         // video_codec_options, set by resolve_common_args()
+    int                                     codec_thread_type = 0; // FF_THREAD_*, 0 = auto
+
+    // v4l2 encoder, the numeric options are parsed into encoder_config directly
+    const char*           enc_bitrate_mode = "vbr";
+    const char*           enc_profile      = "high";
+    const char*           enc_level        = "";
+    ff::V4L2EncoderConfig encoder_config;
+    bool                  use_v4l2_encoder = false; // set by resolve_common_args()
+
+    // --video-codec copy
+    bool copy_video = false; // set by resolve_common_args()
+    bool mjpeg_dht  = false;
+
+    // --video-codec raw
+    bool raw_video         = false; // set by resolve_common_args()
+    int  raw_buffer_mbytes = 256;   // waiting to be written
+
     bool ffmpeg_debug = false;
     bool help         = false;
 };
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <linux/v4l2-controls.h>
+
+#include "auto-exposure.hpp"
+#include "macros/assert.hpp"
+
+namespace {
+// mid grey in linear light
+constexpr auto target = 0.18f;
+
+auto update_control(V4L2ControlBundle& bundle, v4l2::Control& ctrl, int32_t value) -> bool {
+    const auto step = std::max(ctrl.step, 1); // some drivers report 0
+    value           = std::clamp(value / step * step, ctrl.min, ctrl.max);
+    if(value == ctrl.current) {
+        return false;
+    }
+    ensure(v4l2::set_control(bundle.fd, ctrl.id, value));
+    // keep sliders in sync
+    ctrl.current = value;
+    return true;
+}
+} // namespace
+
+auto AutoExposure::init(V4L2ControlBundle* const sensor) -> void {
+    this->sensor = sensor;
+    if(sensor == nullptr) {
+        return;
+    }
+    for(auto& ctrl : sensor->ctrls) {
+        switch(ctrl.id) {
+        case V4L2_CID_EXPOSURE:
+            exposure = &ctrl;
+            break;
+        case V4L2_CID_ANALOGUE_GAIN:
+            gain = &ctrl;
+            break;
+        }
+    }
+}
+
+auto AutoExposure::update(const std::span<const float> lumas, const size_t saturated) -> void {
+    if(exposure == nullptr || lumas.empty()) {
+        return;
+    }
+    if(settle > 0) {
+        settle -= 1;
+        return;
+    }
+
+    constexpr auto bins = 64;
+    auto           hist = std::array<int, bins>();
+    auto           sum  = 0.0f;
+    for(const auto l : lumas) {
+        const auto luma = std::clamp(l, 0.0f, 1.0f);
+        hist[std::min(int(luma * bins), bins - 1)] += 1;
+        sum += luma;
+    }
+    const auto mean = sum / lumas.size();
+
+    // brightness below which 98% of the blocks lie
+    auto p98 = 1.0f;
+    for(auto i = 0, acc = 0; i < bins; i += 1) {
+        acc += hist[i];
+        if(acc >= int(lumas.size() * 98 / 100)) {
+            p98 = (i + 1.0f) / bins;
+            break;
+        }
+    }
+
+    auto factor = std::clamp(target / std::max(mean, 1e-4f), 0.25f, 4.0f);
+    if(p98 >= 0.95f) {
+        // do not push highlights further into clipping
+        factor = std::min(factor, 1.0f);
+    }
+    if(saturated * 20 > lumas.size()) {
+        factor = std::min(factor, 0.8f);
+    }
+    if(std::abs(std::log2(factor)) < 0.1f) {
+        return;
+    }
+    // approach the target over a few iterations to avoid oscillation
+    factor = std::sqrt(factor);
+
+    // prefer longer exposure over more gain to keep noise low
+    const auto gain_now = gain != nullptr ? std::max(gain->current, 1) : 1;
+    const auto gain_min = gain != nullptr ? std::max(gain->min, 1) : 1;
+    const auto total    = double(exposure->current) * gain_now * factor;
+    const auto new_exp  = std::clamp(total / gain_min, double(exposure->min), double(exposure->max));
+
+    auto changed = update_control(*sensor, *exposure, int32_t(std::lround(new_exp)));
+    if(gain != nullptr) {
+        changed |= update_control(*sensor, *gain, int32_t(std::lround(total / new_exp)));
+    }
+    if(changed) {
+        settle = 3;
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <span>
+
+#include "ui-v4l2.hpp"
+
+// drives sensor exposure and analogue gain so that the mean brightness approaches mid grey
+class AutoExposure {
+  private:
+    V4L2ControlBundle* sensor   = nullptr;
+    v4l2::Control*     exposure = nullptr;
+    v4l2::Control*     gain     = nullptr;
+    int                settle   = 0; // updates to ignore until the last sensor change takes effect
+
+  public:
+    // sensor may be null, then update() does nothing
+    auto init(V4L2ControlBundle* sensor) -> void;
+    // lumas: linear brightness of each statistics block in 0..1
+    // saturated: number of blocks that are mostly clipped
+    auto update(std::span<const float> lumas, size_t saturated) -> void;
+};
@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <array>
+
+#include "aaa.hpp"
+
+namespace camss {
+namespace {
+auto luma_of(const BayerStatsBlock& block) -> float {
+    const auto& wb = bayer_params.wb_gain;
+    return 0.299f * block.r * wb[0] + 0.587f * block.g * wb[1] + 0.114f * block.b * wb[2];
+}
+} // namespace
+
+auto AAA::run_ae(const std::span<const BayerStatsBlock> blocks) -> void {
+    lumas.resize(blocks.size());
+    auto saturated = 0uz;
+    for(auto i = 0uz; i < blocks.size(); i += 1) {
+        lumas[i] = luma_of(blocks[i]);
+        saturated += blocks[i].saturated > 0.5f ? 1 : 0;
+    }
+    ae.update(lumas, saturated);
+}
+
+auto AAA::run_awb(const std::span<const BayerStatsBlock> blocks) -> void {
+    // gray world over blocks that are neither clipped nor too dark
+    auto sum = std::array{0.0, 0.0, 0.0};
+    auto num = 0uz;
+    for(const auto& block : blocks) {
+        const auto luma = luma_of(block);
+        if(block.saturated > 0.01f || luma < 0.02f || luma > 0.9f) {
+            continue;
+        }
+        sum[0] += block.r;
+        sum[1] += block.g;
+        sum[2] += block.b;
+        num += 1;
+    }
+    if(num * 10 < blocks.size() || sum[0] <= 0 || sum[2] <= 0) {
+        return;
+    }
+
+    auto&      wb     = bayer_params.wb_gain;
+    const auto target = std::array{float(wb[1] * sum[1] / sum[0]), float(wb[1] * sum[1] / sum[2])};
+    wb[0] += (std::clamp(target[0], 0.25f, 4.0f) - wb[0]) * 0.2f;
+    wb[2] += (std::clamp(target[1], 0.25f, 4.0f) - wb[2]) * 0.2f;
+}
+
+auto AAA::init(V4L2ControlBundle* const sensor) -> void {
+    ae.init(sensor);
+}
+
+auto AAA::process(const std::span<const BayerStatsBlock> blocks) -> void {
+    if(aaa_params.awb) {
+        run_awb(blocks);
+    }
+    if(aaa_params.ae) {
+        run_ae(blocks);
+    }
+}
+} // namespace camss
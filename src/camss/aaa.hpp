@@ -0,0 +1,28 @@
+#pragma once
+#include <span>
+
+#include "../auto-exposure.hpp"
+#include "../graphics/bayer-stats.hpp"
+
+namespace camss {
+struct AAAParams {
+    bool ae  = false; // drive sensor exposure and analogue gain
+    bool awb = false; // drive bayer_params.wb_gain
+};
+
+inline auto aaa_params = AAAParams();
+
+class AAA {
+  private:
+    AutoExposure       ae;
+    std::vector<float> lumas;
+
+    auto run_ae(std::span<const BayerStatsBlock> blocks) -> void;
+    auto run_awb(std::span<const BayerStatsBlock> blocks) -> void;
+
+  public:
+    // sensor may be null, then only awb works
+    auto init(V4L2ControlBundle* sensor) -> void;
+    auto process(std::span<const BayerStatsBlock> blocks) -> void;
+};
+} // namespace camss
@@ -6,8 +6,9 @@
 
 namespace camss {
 auto Args::parse(const int argc, const char* const* argv) -> std::optional<Args> {
-    auto args   = Args();
-    auto parser = args::Parser<uint8_t, uint16_t>();
+    auto args        = Args();
+    args.video_codec = "v4l2-h264"; // no software path, the bayer frames live on the gpu
+    auto parser      = args::Parser<uint8_t, uint16_t>();
     parser.kwarg(&args.media_device, {"-m", "--media"}, "PATH", "media device", {.state = args::State::DefaultValue});
     parser.kwarg(&args.csiphy, {"--csiphy"}, "N", "csiphy index");
     parser.kwarg(&args.csid, {"--csid"}, "N", "csid index", {.state = args::State::DefaultValue});
@@ -22,8 +23,15 @@ auto Args::parse(const int argc, const char* const* argv) -> std::optional<Args>
     parser.kwarg(&args.wb_b, {"--wb-b"}, "GAIN", "blue white-balance gain", {.state = args::State::DefaultValue});
     parser.kwarg(&args.lsc, {"--lsc"}, "STRENGTH", "lens shading correction strength", {.state = args::State::DefaultValue});
     parser.kwarg(&args.rotate, {"--rotate"}, "DEG", "rotate the image clockwise: 0, 90, 180 or 270", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.color_profile, {"--color-profile"}, "PATH", "sensor color profile, overrides the debayer options", {.state = args::State::Initialized});
+    parser.kwflag(&args.ae, {"--ae"}, "enable auto exposure");
+    parser.kwflag(&args.awb, {"--awb"}, "enable auto white balance");
     parser.kwarg(&args.savedir, {"-o", "--output"}, "PATH", "output directory for photos/videos", {.state = args::State::DefaultValue});
-    // parser.kwarg(&args.video_codec, {"--video-codec"}, "CODEC", "video codec for recording (see ffmpeg -codecs)", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.burst, {"--burst"}, "N", "photos taken from consecutive frames per press, 0 = while held", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.burst_mbytes, {"--burst-size"}, "MIB", "memory for photos waiting to be saved, frames over it are dropped", {.state = args::State::DefaultValue});
+    parser.kwarg(&args.video_codec, {"--video-codec"}, "v4l2-{h264|hevc|vp8|vp9}|raw", "video codec for recording, raw writes the bayer buffers", {.state = args::State::DefaultValue});
+    setup_encoder_args(args, parser);
+    setup_recording_args(args, parser);
     parser.kwarg(&args.audio_codec, {"--audio-codec"}, "CODEC", "audio codec for recording (see ffmpeg -codecs)", {.state = args::State::DefaultValue});
     parser.kwarg(&args.video_filter, {"--video-filter"}, "FILTER", "video filter", {.state = args::State::Initialized});
     parser.kwarg(&args.audio_sample_rate, {"--audio-sample-rate"}, "NUM", "audio sampling rate", {.state = args::State::DefaultValue});
@@ -34,6 +42,9 @@ auto Args::parse(const int argc, const char* const* argv) -> std::optional<Args>
         exit(0);
     }
     ensure(args.rotate % 90 == 0);
+
+    ensure(resolve_common_args(args));
+    ensure(args.use_v4l2_encoder || args.raw_video, "only the v4l2 encoder or raw is supported");
     return args;
 }
 } // namespace camss
@@ -1,8 +1,8 @@
+#include <print>
+
 #include <coop/io.hpp>
 #include <coop/parallel.hpp>
 #include <coop/task-handle.hpp>
-#include <coop/thread.hpp>
-#include <sys/ioctl.h>
 
 #include "../file.hpp"
 #include "../graphics/bayer.hpp"
@@ -10,38 +10,77 @@
 #include "../macros/unwrap.hpp"
 #include "camera.hpp"
 
-namespace {
-auto find_venus_encoder_node() -> std::optional<std::string> {
-    for(auto i = 0; i < 32; i += 1) {
-        auto       path = std::format("/dev/video{}", i);
-        const auto fd   = open(path.data(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
-        if(fd < 0) {
-            continue;
-        }
-        auto cap = v4l2_capability();
-        auto ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
-        close(fd);
-        if(ret != 0) {
-            continue;
-        }
-        if(std::string_view((const char*)cap.driver) != "qcom-venus") {
-            continue;
-        }
-        if(!std::string_view((const char*)cap.card).contains("encoder")) {
-            continue;
+namespace camss {
+auto Camera::create_record_context(Loader& loader, std::string path, const bool standby) -> coop::Async<bool> {
+    constexpr static auto error_value = false;
+
+    auto rec = std::array{params.width, params.height};
+    if(bayer_params.rotate % 2 != 0) {
+        std::swap(rec[0], rec[1]);
+    }
+
+    if(params.args->raw_video) {
+        // the bayer buffers as captured, debayering is left to the reader
+        const auto format = RawFormat{
+            .fourcc         = params.fourcc,
+            .width          = params.width,
+            .height         = params.height,
+            .stride         = params.stride,
+            .max_frame_size = size_t(params.stride) * params.height,
+        };
+        auto ctx     = std::make_unique<RecordContext>();
+        ctx->standby = standby;
+        co_ensure_v(co_await loader.thread.run([&]() {
+            return ctx->init_raw(std::move(path), format, *params.args);
+        }));
+        if(standby && this->rec) {
+            co_return true;
         }
-        return path;
+        this->rec = std::move(ctx);
+        co_return true;
+    }
+
+    const auto fps = params.window_context->capture_rate > 0 ? params.window_context->capture_rate : 30;
+
+    co_ensure_v(!encoder_node.empty()); // none was found by start()
+
+    // the encoder renders with the gl context of this thread, the rest can go
+    auto enc = std::make_unique<ff::V4L2Encoder>();
+    co_ensure_v(enc->init(encoder_node.data(), rec[0], rec[1], fps, *params.encoder_config));
+    auto ctx     = std::make_unique<RecordContext>();
+    ctx->standby = standby;
+    co_ensure_v(co_await loader.thread.run([&]() {
+        return ctx->init(std::move(path), rec[0], rec[1], enc->coded_width(), enc->coded_height(), *params.args);
+    }));
+    if(standby && this->rec) {
+        // recording was started meanwhile
+        co_return true;
     }
-    return std::nullopt;
+
+    this->enc = std::move(enc);
+    this->rec = std::move(ctx);
+    co_return true;
 }
 
-} // namespace
+auto Camera::stop_recording(Loader& loader) -> coop::Async<void> {
+    if(enc) {
+        enc->drain([&](ff::V4L2Encoder::Packet& p) {
+            rec->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+        });
+    }
+    enc.reset();
+    preroll_pending = params.args->preroll > 0;
+    // detach first, then let the loader's thread write the trailer or the last raw chunks
+    auto ctx = std::exchange(rec, nullptr);
+    co_await loader.thread.run([&]() {
+        ctx.reset();
+    });
+}
 
-namespace camss {
 auto Camera::loader_main(const size_t index) -> coop::Async<void> {
-    auto& event = loaders[index].event;
+    auto& loader = loaders[index];
 loop:
-    co_await event;
+    co_await loader.event;
 
     const auto frame_count = (current_frame_count += 1);
 
@@ -49,6 +88,10 @@ loop:
     auto       frame       = std::shared_ptr<Frame>(bayer_frame);
     const auto byte_array  = Frame::ByteArray{static_cast<const std::byte*>(params.mmap_ptrs[index]), params.dmabufs[index].length};
     coop_ensure(frame->load_texture(byte_array));
+    if(rec && rec->raw && rec->wants_frames()) {
+        // every frame is kept, and before the buffer goes back to the driver
+        rec->raw->add_frame(byte_array.first(size_t(params.stride) * params.height), rec->timer.elapsed<std::chrono::microseconds>());
+    }
     coop_ensure(v4l2::queue_buffer_mp(params.fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_DMABUF, index, &params.dmabufs[index], 1));
 
     if(front_frame_count < frame_count) {
@@ -59,58 +102,119 @@ loop:
     }
     params.window_context->frame = frame;
 
+    // 3a, one statistics readback in flight at a time
+    if(aaa_params.ae || aaa_params.awb) {
+        if(!stats) {
+            stats.emplace();
+        }
+        if(const auto blocks = stats->poll()) {
+            aaa.process({blocks, BayerStats::grid_width * BayerStats::grid_height});
+        }
+        bayer_frame->start_stats(*stats);
+    }
+
     // proc command
     switch(std::exchange(params.window_context->camera_command, Command::None)) {
     case Command::TakePhoto: {
-        const auto path = std::format("{}/{}.jpg", params.args->savedir, get_save_filename());
-        coop_ensure(frame->save_to_jpeg(byte_array, path.data()));
-        params.window_context->ui_command = Command::TakePhotoDone;
+        burst.start(params.args->burst);
     } break;
     case Command::StartRecording: {
-        const auto path = std::format("{}/{}.mkv", params.args->savedir, get_save_filename());
+        const auto path  = std::format("{}/{}.{}", params.args->savedir, get_save_filename(), params.args->raw_video ? "raw" : "mkv");
+        auto       timer = Timer();
+        const auto warm  = rec != nullptr;
 
-        auto rec = std::array{params.width, params.height};
-        if(bayer_params.rotate % 2 != 0) {
-            std::swap(rec[0], rec[1]);
+        preroll_pending = false;
+        if(!warm) {
+            coop_ensure(co_await create_record_context(loader, path, false));
         }
-
-        const auto fps     = params.window_context->capture_rate > 0 ? params.window_context->capture_rate : 30;
-        const auto bitrate = 200000 * fps;
-
-        auto enc = std::make_unique<ff::V4L2H264Encoder>();
-        coop_ensure(enc->init(venus_node.data(), rec[0], rec[1], bitrate, fps));
-        auto ctx = std::make_unique<RecordContext>();
-        coop_ensure(ctx->init(path, rec[0], rec[1], enc->coded_width(), enc->coded_height(), *params.args));
-
-        this->enc = std::move(enc);
-        this->rec = std::move(ctx);
+        if(warm || params.args->preroll > 0) {
+            // the encoder was set up already, only the file is new
+            coop_ensure(rec->start(path));
+        }
+        std::println("recording started in {}ms{}", timer.elapsed<std::chrono::milliseconds>(), warm ? " (warm)" : "");
 
         params.window_context->ui_command = Command::StartRecordingDone;
     } break;
     case Command::StopRecording: {
-        if(rec) {
-            enc->drain([&](const ff::V4L2H264Encoder::Packet& p) {
-                rec->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe);
-            });
-            enc.reset();
-            rec.reset();
-        }
-
+        co_await stop_recording(loader);
         params.window_context->ui_command = Command::StopRecordingDone;
     } break;
     default:
         break;
     }
+    if(burst.next(params.window_context->shutter_held)) {
+        // readbacks in flight are not counted, at most a few frames of them
+        const auto queued = photo_saver.has_room();
+        if(queued) {
+            const auto path = std::format("{}/{}.jpg", params.args->savedir, get_save_filename());
+            if(!packer) {
+                packer.emplace();
+            }
+            stills.push_back({bayer_frame->start_download(*packer), path});
+        }
+        burst.record(queued);
+    }
+    if(params.window_context->ui_command == Command::None && photo_saver.poll_done()) {
+        // one notice for a whole burst, never over another command
+        params.window_context->ui_command = Command::TakePhotoDone;
+    }
+    if(std::exchange(preroll_pending, false)) {
+        // never written unless recording starts, the name only picks the container
+        coop_ensure(co_await create_record_context(loader, std::format("{}/preroll.mkv", params.args->savedir), false));
+    }
+    // movie mode keeps an idle encoder so that pressing record only opens the file
+    const auto movie = params.window_context->movie && params.args->preroll == 0;
+    if(!movie) {
+        standby_failed = false;
+    }
+    if(movie && !rec && !warming && !standby_failed) {
+        warming = true;
+        if(!co_await create_record_context(loader, std::format("{}/standby.mkv", params.args->savedir), true)) {
+            WARN("failed to create the standby encoder, recording will start cold");
+            standby_failed = true;
+        }
+        warming = false;
+    } else if(!movie && rec && rec->standby && !rec->started) {
+        co_await stop_recording(loader);
+    }
 
-    if(rec) {
+    if(rec && !rec->raw && rec->wants_frames()) {
         const auto ts = rec->timer.elapsed<std::chrono::microseconds>();
-        if(const auto tex = bayer_frame->get_rgba_texture()) {
-            coop_ensure(enc->encode(*tex, ts, [&](const ff::V4L2H264Encoder::Packet& p) {
-                rec->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe);
-            }));
+        // debayer straight into the encoder's buffers, rgba is left to the preview
+        const auto render = [bayer_frame](const GLuint fbo_y, const GLuint fbo_uv, const int width, const int height) {
+            bayer_frame->render_nv12(fbo_y, fbo_uv, width, height);
+        };
+        if(rec->encoder.take_keyframe_request()) {
+            enc->force_keyframe(); // lets the next segment start on time
+        }
+        coop_ensure(enc->encode(render, ts, [&](ff::V4L2Encoder::Packet& p) {
+            rec->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+        }));
+        if(rec->encoder.has_failed()) {
+            co_await stop_recording(loader);
+            params.window_context->ui_command = Command::RecordingFailed;
         }
     }
 
+    if(!stills.empty()) {
+        // give the saver a chance to pick up finished readbacks
+        saver_event.notify();
+    }
+
+    goto loop;
+}
+
+auto Camera::saver_main() -> coop::Async<void> {
+loop:
+    co_await saver_event;
+
+    while(!stills.empty() && stills.front().still->download.is_ready()) {
+        auto& [still, path] = stills.front();
+        // map on this thread, encode on the workers
+        photo_saver.push(still->prepare_jpeg(still->download.map()), std::move(path));
+        stills.pop_front();
+    }
+
     goto loop;
 }
 
@@ -122,6 +226,7 @@ auto Camera::dispatcher_main() -> coop::Async<bool> {
     for(auto i = 0u; i < loaders.size(); i += 1) {
         runner.push_task(loader_main(i), &loaders[i].task);
     }
+    runner.push_task(saver_main(), &saver);
 
     auto counter = FPSCounter();
 loop:
@@ -138,15 +243,28 @@ loop:
 }
 
 auto Camera::init(CameraParams params) -> bool {
-    this->params = std::move(params);
-
-    unwrap_mut(node, find_venus_encoder_node());
-    this->venus_node = std::move(node);
-
+    this->params    = std::move(params);
+    preroll_pending = this->params.args->preroll > 0;
+    photo_saver.init(0, size_t(this->params.args->burst_mbytes) * 1024 * 1024);
+    aaa.init(this->params.sensor_controls);
     return true;
 }
 
 auto Camera::start() -> coop::Async<void> {
+    if(!params.args->raw_video) {
+        // picked once before the capture starts, the benchmark takes seconds per node
+        // fed through the gpu like the recording, the window's context is current here
+        auto rec = std::array{params.width, params.height};
+        if(bayer_params.rotate % 2 != 0) {
+            std::swap(rec[0], rec[1]);
+        }
+        if(const auto node = ff::select_v4l2_encoder(rec[0], rec[1], *params.encoder_config, true)) {
+            encoder_node = *node;
+        } else {
+            WARN("no usable v4l2 encoder, recording will fail");
+        }
+    }
+
     auto& runner = *co_await coop::reveal_runner();
     runner.push_task(dispatcher_main(), &dispatcher);
 }
@@ -155,6 +273,7 @@ auto Camera::shutdown() -> void {
     for(auto& loader : loaders) {
         loader.task.cancel();
     }
+    saver.cancel();
     dispatcher.cancel();
 }
 
@@ -1,46 +1,80 @@
 #pragma once
+#include <deque>
+
 #include <coop/generator.hpp>
 #include <coop/promise.hpp>
 #include <coop/single-event.hpp>
+#include <coop/thread.hpp>
 
 #include "../args.hpp"
+#include "../graphics-wrapper.hpp"
+#include "../photo-saver.hpp"
 #include "../record-context.hpp"
 #include "../v4l2-encoder/encoder.hpp"
 #include "../v4l2.hpp"
 #include "../window.hpp"
+#include "aaa.hpp"
 
 namespace camss {
 constexpr auto num_buffers = 4;
 
 struct CameraParams {
-    int                    fd;
-    uint32_t               width;
-    uint32_t               height;
-    uint32_t               stride;
-    const v4l2::DMABuffer* dmabufs;   // num_buffers entries, used to requeue
-    void* const*           mmap_ptrs; // CPU-readable mapping of each dmabuf
-    WindowContext*         window_context;
-    const CommonArgs*      args;
+    int                          fd;
+    uint32_t                     width;
+    uint32_t                     height;
+    uint32_t                     stride;
+    uint32_t                     fourcc;    // bayer format of the buffers, for --video-codec raw
+    const v4l2::DMABuffer*       dmabufs;   // num_buffers entries, used to requeue
+    void* const*                 mmap_ptrs; // CPU-readable mapping of each dmabuf
+    WindowContext*               window_context;
+    const CommonArgs*            args;
+    V4L2ControlBundle*           sensor_controls; // nullable, used by auto exposure
+    const ff::V4L2EncoderConfig* encoder_config;
 };
 
 class Camera {
   private:
     struct Loader {
+        coop::Thread      thread; // blocking work that needs no gl context
         coop::SingleEvent event;
         coop::TaskHandle  task;
     };
 
+    struct PendingStill {
+        std::unique_ptr<BayerStill> still;
+        std::string                 path;
+    };
+
     CameraParams                    params;
     std::array<Loader, num_buffers> loaders;
     coop::TaskHandle                dispatcher;
     size_t                          current_frame_count = 0;
     size_t                          front_frame_count   = 0;
-    std::string                     venus_node;
+    std::string                     encoder_node; // chosen by start()
+
+    std::unique_ptr<ff::V4L2Encoder> enc;
+    std::unique_ptr<RecordContext>   rec;
+    bool                             preroll_pending = false; // --preroll, start encoding on the next frame
+    bool                             warming         = false; // a loader is creating the standby context
+    bool                             standby_failed  = false; // not retried until movie mode is entered again
+
+    // stills waiting for readback, in request order
+    std::deque<PendingStill> stills;
+    coop::SingleEvent        saver_event;
+    coop::TaskHandle         saver;
+    std::optional<YUVPacker> packer; // created on the first photo
+    Burst                    burst;
+    PhotoSaver               photo_saver;
 
-    std::unique_ptr<ff::V4L2H264Encoder> enc;
-    std::unique_ptr<RecordContext>       rec;
+    // 3a
+    AAA                       aaa;
+    std::optional<BayerStats> stats;
 
+    // needs the gl context of the loaders
+    auto create_record_context(Loader& loader, std::string path, bool standby) -> coop::Async<bool>;
+    auto stop_recording(Loader& loader) -> coop::Async<void>;
     auto loader_main(size_t index) -> coop::Async<void>;
+    auto saver_main() -> coop::Async<void>;
     auto dispatcher_main() -> coop::Async<bool>;
 
   public:
@@ -13,6 +13,7 @@
 
 #include "../gawl/wayland/application.hpp"
 #include "../graphics/bayer.hpp"
+#include "../graphics/yuv-pack.hpp"
 #include "../macros/unwrap.hpp"
 #include "../media-device.hpp"
 #include "../udev.hpp"
@@ -144,6 +145,7 @@ class CamssWindowCallbacks : public WindowCallbacks {
 
 // ui.cpp
 auto add_debayer_param_buttons(std::vector<std::unique_ptr<Button>>& buttons) -> void;
+auto add_aaa_buttons(std::vector<std::unique_ptr<Button>>& buttons) -> void;
 
 auto main(const int argc, const char* const argv[]) -> int {
     unwrap(args, camss::Args::parse(argc, argv));
@@ -193,20 +195,13 @@ auto main(const int argc, const char* const argv[]) -> int {
     bayer_params.wb_gain     = {args.wb_r / 100.f, args.wb_g / 100.f, args.wb_b / 100.f};
     bayer_params.lsc         = args.lsc / 100.f;
     bayer_params.rotate      = args.rotate / 90;
+    if(args.color_profile[0] != '\0') {
+        ensure(load_color_profile(args.color_profile, bayer_params));
+    }
     ensure(init_bayer_shader());
+    ensure(init_yuv_pack_shader());
 
     auto cbs = std::shared_ptr<CamssWindowCallbacks>(new CamssWindowCallbacks());
-    ensure(cbs->cam.init({
-        .fd             = fd,
-        .width          = width,
-        .height         = height,
-        .stride         = stride,
-        .dmabufs        = dmabufs.data(),
-        .mmap_ptrs      = mmap_ptrs.data(),
-        .window_context = &cbs->get_context(),
-        .args           = &args,
-    }));
-
     auto bundle_sensor = V4L2ControlBundle{
         .fd    = pipeline.sensor_fd.as_handle(),
         .ctrls = v4l2::query_controls(pipeline.sensor_fd.as_handle()),
@@ -239,6 +234,23 @@ auto main(const int argc, const char* const argv[]) -> int {
         build_buttons_from_controls(bundle_vcm, cbs->buttons);
     }
     add_debayer_param_buttons(cbs->buttons);
+    // the toggles show the initial state
+    camss::aaa_params = {.ae = args.ae, .awb = args.awb};
+    add_aaa_buttons(cbs->buttons);
+
+    ensure(cbs->cam.init({
+        .fd              = fd,
+        .width           = width,
+        .height          = height,
+        .stride          = stride,
+        .fourcc          = bayer_fmt.fourcc,
+        .dmabufs         = dmabufs.data(),
+        .mmap_ptrs       = mmap_ptrs.data(),
+        .window_context  = &cbs->get_context(),
+        .args            = &args,
+        .sensor_controls = &bundle_sensor,
+        .encoder_config  = &args.encoder_config,
+    }));
 
     auto runner = coop::Runner();
     runner.push_task(app.run());
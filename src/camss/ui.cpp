@@ -2,6 +2,7 @@
 
 #include "../graphics/bayer.hpp"
 #include "../ui.hpp"
+#include "aaa.hpp"
 
 namespace {
 struct DebayerSlider : Slider {
@@ -50,6 +51,27 @@ auto make_button(std::string name, float& dest, uint16_t min, uint16_t max, uint
     button->slider.denom = denom;
     return button;
 }
+struct ToggleButton : Button {
+    std::string name;
+    bool*       dest;
+
+    auto get_label() -> std::string_view override {
+        return name;
+    }
+
+    auto on_pressed() -> void override {
+        *dest   = !*dest;
+        pressed = *dest;
+    }
+};
+
+auto make_toggle(std::string name, bool& dest) -> std::unique_ptr<ToggleButton> {
+    auto button     = std::make_unique<ToggleButton>();
+    button->name    = std::move(name);
+    button->dest    = &dest;
+    button->pressed = dest;
+    return button;
+}
 } // namespace
 
 auto add_debayer_param_buttons(std::vector<std::unique_ptr<Button>>& buttons) -> void {
@@ -60,3 +82,8 @@ auto add_debayer_param_buttons(std::vector<std::unique_ptr<Button>>& buttons) ->
     buttons.emplace_back(make_button("WB B", bayer_params.wb_gain[2], 0, 400, 100));
     buttons.emplace_back(make_button("LSC", bayer_params.lsc, 0, 200, 100));
 }
+
+auto add_aaa_buttons(std::vector<std::unique_ptr<Button>>& buttons) -> void {
+    buttons.emplace_back(make_toggle("Auto Exposure", camss::aaa_params.ae));
+    buttons.emplace_back(make_toggle("Auto WB", camss::aaa_params.awb));
+}
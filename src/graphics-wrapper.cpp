@@ -9,26 +9,44 @@
 #include "yuv.hpp"
 
 namespace {
-auto save_yuvp_frame(const char* const path, const int width, const int height, const int stride, const int ppc_x, const int ppc_y, const std::byte* const y, const std::byte* const u, const std::byte* const v) -> bool {
-    unwrap(jpeg, jpg::encode_yuvp_to_jpeg(width, height, stride, ppc_x, ppc_y, y, u, v));
+// the capture buffer goes back to the driver, the writer keeps its own copy
+auto copy_pixels(const Frame::ByteArray buf) -> std::shared_ptr<const std::vector<std::byte>> {
+    return std::make_shared<const std::vector<std::byte>>(buf.begin(), buf.end());
+}
+
+auto save_yuvp_frame(const char* const path, const int width, const int height, const int stride, const int ppc_x, const int ppc_y, const std::byte* const y, const std::byte* const u, const std::byte* const v, const int quality = 100) -> bool {
+    unwrap(jpeg, jpg::encode_yuvp_to_jpeg(width, height, stride, ppc_x, ppc_y, y, u, v, quality));
     ensure(write_file(path, {jpeg.buffer.get(), jpeg.size}));
     return true;
 }
 
+// offsets of the y, cb and cr planes and the total size
+auto yuv420p_layout(const int width, const int height) -> std::array<size_t, 4> {
+    const auto stride = size_t(width + 1) / 2 * 2;
+    const auto luma   = stride * height;
+    const auto chroma = stride / 2 * size_t((height + 1) / 2);
+    return {0, luma, luma + chroma, luma + chroma * 2};
+}
+
 auto rotated_out(const int w, const int h) -> std::pair<int, int> {
     return (bayer_params.rotate % 2) != 0 ? std::pair{h, w} : std::pair{w, h};
 }
 } // namespace
 
 // JpegFrame
-auto JpegFrame::save_to_jpeg(const ByteArray buf, const char* const path) -> bool {
-    const auto size = jpg::calc_jpeg_size(buf.data());
-    ensure(write_file(path, ByteArray(buf.data(), size)));
-    return true;
+auto JpegFrame::prepare_jpeg(const ByteArray buf) -> std::optional<JpegWriter> {
+    unwrap(size, jpg::calc_jpeg_size(buf));
+    auto write = [data = copy_pixels(buf.first(size))](const char* const path) -> bool {
+        ensure(write_file(path, ByteArray(*data)));
+        return true;
+    };
+    return JpegWriter{std::move(write), size};
 }
 
 auto JpegFrame::load_texture(const ByteArray buf) -> bool {
-    decoded = jpg::decode_jpeg_to_yuvp(buf.data(), buf.size(), 1);
+    // a flaky usb link delivers cut frames, drop them before the decoder sees them
+    unwrap(size, jpg::calc_jpeg_size(buf));
+    decoded = jpg::decode_jpeg_to_yuvp(buf.data(), size, 1);
     ensure(decoded);
     graphic.update_texture(decoded->width, decoded->height, 0, decoded->ppc_x, decoded->ppc_y, decoded->y.data(), decoded->u.data(), decoded->v.data());
     return true;
@@ -61,10 +79,15 @@ auto JpegFrame::get_planes(ByteArray /*buf*/) const -> std::optional<std::vector
 }
 
 // YUV422IFrame
-auto YUV422IFrame::save_to_jpeg(const ByteArray buf, const char* const path) -> bool {
-    const auto [ybuf, ubuf, vbuf] = yuv::yuv422i_to_yuv422p(buf.data(), width, height, stride);
-    ensure(save_yuvp_frame(path, width, height, stride / 2, 2, 1, ybuf.data(), ubuf.data(), vbuf.data()));
-    return true;
+auto YUV422IFrame::prepare_jpeg(const ByteArray buf) -> std::optional<JpegWriter> {
+    const auto size = size_t(stride) * height;
+    ensure(size <= buf.size());
+    auto write = [data = copy_pixels(buf.first(size)), width = width, height = height, stride = stride](const char* const path) -> bool {
+        const auto [ybuf, ubuf, vbuf] = yuv::yuv422i_to_yuv422p(data->data(), width, height, stride);
+        ensure(save_yuvp_frame(path, width, height, stride / 2, 2, 1, ybuf.data(), ubuf.data(), vbuf.data()));
+        return true;
+    };
+    return JpegWriter{std::move(write), size};
 }
 
 auto YUV422IFrame::load_texture(ByteArray buf) -> bool {
@@ -92,14 +115,19 @@ YUV422IFrame::YUV422IFrame(const int width, const int height, const int stride)
 }
 
 // YUV420SPFrame
-auto YUV420SPFrame::save_to_jpeg(const ByteArray buf, const char* const path) -> bool {
-    const auto uvbuf = buf.data() + stride * height;
-    auto       ubuf  = std::vector<std::byte>(height / 4 * width);
-    auto       vbuf  = std::vector<std::byte>(height / 4 * width);
-
-    yuv::yuv420sp_uvsp_to_uvp(uvbuf, ubuf.data(), vbuf.data(), width, height, stride);
-    ensure(save_yuvp_frame(path, width, height, stride, 2, 2, buf.data(), ubuf.data(), vbuf.data()));
-    return true;
+auto YUV420SPFrame::prepare_jpeg(const ByteArray buf) -> std::optional<JpegWriter> {
+    const auto size = size_t(stride) * height * 3 / 2;
+    ensure(size <= buf.size());
+    auto write = [data = copy_pixels(buf.first(size)), width = width, height = height, stride = stride](const char* const path) -> bool {
+        const auto uvbuf = data->data() + stride * height;
+        auto       ubuf  = std::vector<std::byte>(height / 4 * width);
+        auto       vbuf  = std::vector<std::byte>(height / 4 * width);
+
+        yuv::yuv420sp_uvsp_to_uvp(uvbuf, ubuf.data(), vbuf.data(), width, height, stride);
+        ensure(save_yuvp_frame(path, width, height, stride, 2, 2, data->data(), ubuf.data(), vbuf.data()));
+        return true;
+    };
+    return JpegWriter{std::move(write), size};
 }
 
 auto YUV420SPFrame::load_texture(ByteArray buf) -> bool {
@@ -128,6 +156,29 @@ YUV420SPFrame::YUV420SPFrame(const int width, const int height, const int stride
       stride(stride) {
 }
 
+// BayerStill
+auto BayerStill::plane_offset(const int plane) const -> size_t {
+    return yuv420p_layout(width, height)[plane];
+}
+
+auto BayerStill::stride() const -> int {
+    return (width + 1) / 2 * 2;
+}
+
+auto BayerStill::prepare_jpeg(const std::byte* const pixels) const -> JpegWriter {
+    auto write = [data = copy_pixels({pixels, plane_offset(3)}), width = width, height = height, stride = stride(), u = plane_offset(1), v = plane_offset(2)](const char* const path) -> bool {
+        const auto p = data->data();
+        return save_yuvp_frame(path, width, height, stride, 2, 2, p, p + u, p + v, 90);
+    };
+    return JpegWriter{std::move(write), plane_offset(3)};
+}
+
+BayerStill::BayerStill(const int width, const int height)
+    : download(yuv420p_layout(width, height)[3]),
+      width(width),
+      height(height) {
+}
+
 // BayerFrame
 auto BayerFrame::ensure_rgba() -> void {
     if(fbo.has_value()) {
@@ -138,22 +189,39 @@ auto BayerFrame::ensure_rgba() -> void {
     graphic.draw_rect(*fbo, gawl::Rectangle{{0, 0}, {double(ow), double(oh)}});
 }
 
-auto BayerFrame::save_to_jpeg(ByteArray /*buf*/, const char* const path) -> bool {
+auto BayerFrame::prepare_jpeg(ByteArray /*buf*/) -> std::optional<JpegWriter> {
+    // stalls on the readback, the camss loop uses start_download() instead
+    auto       packer = YUVPacker();
+    const auto still  = start_download(packer);
+    still->download.wait();
+    return still->prepare_jpeg(still->download.map());
+}
+
+auto BayerFrame::start_download(YUVPacker& packer) -> std::unique_ptr<BayerStill> {
     ensure_rgba();
 
-    // download pixels
     const auto [ow, oh] = rotated_out(width, height);
-    const auto row      = ow * 4uz;
-    auto       rgba     = std::vector<std::byte>(row * oh);
+    auto       still    = std::make_unique<BayerStill>(ow, oh);
+
+    // convert on the gpu so that only 12 bits per pixel cross the bus
+    packer.resize(ow, oh);
+    packer.render(fbo->get_texture());
+    for(auto i = 0; i < 3; i += 1) {
+        const auto [w, h] = packer.plane_size(i);
+        glBindFramebuffer(GL_FRAMEBUFFER, packer.get_framebuffer(i));
+        still->download.read(w, h, GL_RED, still->plane_offset(i));
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    still->download.submit();
+    return still;
+}
 
-    const auto binder = fbo->prepare();
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(0, 0, ow, oh, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+auto BayerFrame::start_stats(BayerStats& stats) -> void {
+    stats.start(graphic);
+}
 
-    // write to file
-    unwrap(jpeg, jpg::encode_rgba_to_jpeg(ow, oh, ow * 4, rgba.data(), 90, true));
-    ensure(write_file(path, ByteArray(jpeg.buffer.get(), jpeg.size)));
-    return true;
+auto BayerFrame::render_nv12(const GLuint fbo_y, const GLuint fbo_uv, const int plane_width, const int plane_height) -> void {
+    graphic.draw_nv12(fbo_y, fbo_uv, plane_width, plane_height);
 }
 
 auto BayerFrame::get_rgba_texture() const -> std::optional<GLuint> {
@@ -1,4 +1,6 @@
 #pragma once
+#include <functional>
+#include <memory>
 #include <optional>
 #include <span>
 
@@ -6,18 +8,28 @@
 
 #include "gawl/empty-texture.hpp"
 #include "gawl/screen.hpp"
+#include "graphics/bayer-stats.hpp"
 #include "graphics/bayer.hpp"
+#include "graphics/pixel-download.hpp"
 #include "graphics/planar.hpp"
+#include "graphics/yuv-pack.hpp"
 #include "graphics/yuv420sp.hpp"
 #include "graphics/yuv422i.hpp"
 #include "jpeg.hpp"
 #include "video-encoder/encoder.hpp"
 
+// encodes and writes a copy of a frame, can run on any thread
+struct JpegWriter {
+    std::function<bool(const char* path)> write;
+    size_t                                bytes; // copied pixels, held until written
+};
+
 class Frame {
   public:
     using ByteArray = std::span<const std::byte>;
 
-    virtual auto save_to_jpeg(ByteArray buf, const char* path) -> bool                    = 0;
+    // copies what the encoder needs out of buf, which can be requeued right after
+    virtual auto prepare_jpeg(ByteArray buf) -> std::optional<JpegWriter>                 = 0;
     virtual auto load_texture(ByteArray buf) -> bool                                      = 0;
     virtual auto draw_fit_rect(gawl::Screen& screen, const gawl::Rectangle& rect) -> void = 0;
     virtual auto get_pixel_format() const -> std::optional<AVPixelFormat>                 = 0;
@@ -32,7 +44,7 @@ class JpegFrame : public Frame {
     std::optional<jpg::DecodeResult> decoded;
 
   public:
-    auto save_to_jpeg(ByteArray buf, const char* path) -> bool override;
+    auto prepare_jpeg(ByteArray buf) -> std::optional<JpegWriter> override;
     auto load_texture(ByteArray buf) -> bool override;
     auto draw_fit_rect(gawl::Screen& screen, const gawl::Rectangle& rect) -> void override;
     auto get_pixel_format() const -> std::optional<AVPixelFormat> override;
@@ -47,7 +59,7 @@ class YUV422IFrame : public Frame {
     YUV422iGraphic graphic;
 
   public:
-    auto save_to_jpeg(ByteArray buf, const char* path) -> bool override;
+    auto prepare_jpeg(ByteArray buf) -> std::optional<JpegWriter> override;
     auto load_texture(ByteArray buf) -> bool override;
     auto draw_fit_rect(gawl::Screen& screen, const gawl::Rectangle& rect) -> void override;
     auto get_pixel_format() const -> std::optional<AVPixelFormat> override;
@@ -64,7 +76,7 @@ class YUV420SPFrame : public Frame {
     YUV420spGraphic graphic;
 
   public:
-    auto save_to_jpeg(ByteArray buf, const char* path) -> bool override;
+    auto prepare_jpeg(ByteArray buf) -> std::optional<JpegWriter> override;
     auto load_texture(ByteArray buf) -> bool override;
     auto draw_fit_rect(gawl::Screen& screen, const gawl::Rectangle& rect) -> void override;
     auto get_pixel_format() const -> std::optional<AVPixelFormat> override;
@@ -73,6 +85,21 @@ class YUV420SPFrame : public Frame {
     YUV420SPFrame(int width, int height, int stride);
 };
 
+// debayered image on its way to the cpu, as planar yuv 4:2:0
+struct BayerStill {
+    PixelDownload download;
+    int           width;
+    int           height;
+
+    // byte offsets of each plane in the download, and the luma stride
+    auto plane_offset(int plane) const -> size_t;
+    auto stride() const -> int;
+    // copies the mapped download, the writer outlives this
+    auto prepare_jpeg(const std::byte* pixels) const -> JpegWriter;
+
+    BayerStill(int width, int height);
+};
+
 class BayerFrame : public Frame {
   private:
     int          width;
@@ -86,13 +113,19 @@ class BayerFrame : public Frame {
     auto ensure_rgba() -> void;
 
   public:
-    auto save_to_jpeg(ByteArray buf, const char* path) -> bool override;
+    auto prepare_jpeg(ByteArray buf) -> std::optional<JpegWriter> override;
     auto load_texture(ByteArray buf) -> bool override;
     auto draw_fit_rect(gawl::Screen& screen, const gawl::Rectangle& rect) -> void override;
     auto get_pixel_format() const -> std::optional<AVPixelFormat> override;
     auto get_planes(ByteArray buf) const -> std::optional<std::vector<ff::Plane>> override;
 
     auto get_rgba_texture() const -> std::optional<GLuint>;
+    // start reading back the debayered image without stalling the pipeline
+    // packer is reused across frames, resized to fit
+    auto start_download(YUVPacker& packer) -> std::unique_ptr<BayerStill>;
+    auto start_stats(BayerStats& stats) -> void;
+    // encoder input without going through the rgba texture
+    auto render_nv12(GLuint fbo_y, GLuint fbo_uv, int plane_width, int plane_height) -> void;
 
     BayerFrame(int width, int height, int stride);
 };
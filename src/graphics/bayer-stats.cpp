@@ -0,0 +1,56 @@
+#define GL_GLEXT_PROTOTYPES
+#include <array>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "bayer-stats.hpp"
+
+auto BayerStats::start(BayerGraphic& graphic) -> void {
+    if(in_flight) {
+        return;
+    }
+    download.recycle();
+
+    auto viewport = std::array<GLint, 4>();
+    glGetIntegerv(GL_VIEWPORT, viewport.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, grid_width, grid_height);
+    graphic.draw_stats(grid_width, grid_height);
+    download.read(grid_width, grid_height, GL_RGBA, 0, GL_FLOAT);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    download.submit();
+    in_flight = true;
+}
+
+auto BayerStats::poll() -> const BayerStatsBlock* {
+    if(!in_flight || !download.is_ready()) {
+        return nullptr;
+    }
+    in_flight = false;
+    return reinterpret_cast<const BayerStatsBlock*>(download.map());
+}
+
+BayerStats::BayerStats()
+    : download(sizeof(BayerStatsBlock) * grid_width * grid_height) {
+    static_assert(sizeof(BayerStatsBlock) == sizeof(float) * 4);
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // 8 bits are too coarse for dark scenes
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, grid_width, grid_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+BayerStats::~BayerStats() {
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+}
@@ -0,0 +1,34 @@
+// 3a statistics of a raw Bayer image, reduced on the gpu
+
+#pragma once
+#include "bayer.hpp"
+#include "pixel-download.hpp"
+
+struct BayerStatsBlock {
+    float r; // mean linear value, black level subtracted
+    float g;
+    float b;
+    float saturated; // fraction of samples near full scale
+};
+
+class BayerStats {
+  private:
+    GLuint        texture   = 0;
+    GLuint        fbo       = 0;
+    bool          in_flight = false;
+    PixelDownload download; // reused by every round
+
+  public:
+    constexpr static auto grid_width  = 64;
+    constexpr static auto grid_height = 48;
+
+    // one readback at a time, does nothing while the previous one is in flight
+    auto start(BayerGraphic& graphic) -> void;
+    // grid_width * grid_height blocks, row major from the top of the sensor
+    // nullptr until a readback finishes, valid until the next start()
+    auto poll() -> const BayerStatsBlock*;
+
+    BayerStats(const BayerStats&) = delete;
+    BayerStats();
+    ~BayerStats();
+};
@@ -1,21 +1,24 @@
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <span>
+#include <sstream>
+#include <string>
+
+#include "../macros/unwrap.hpp"
 #include "bayer.hpp"
-#include "../macros/assert.hpp"
+#include "program.hpp"
 
 namespace {
-auto bayer_fragment_shader_source = R"glsl(
-    #version 330 core
-
+// raw sample access, shared by the display and statistics passes
+auto bayer_common_source = R"glsl(
     in vec2           tex_coordinate;
     uniform sampler2D tex_0;
 
     uniform vec2  img_size;
     uniform vec2  bayer_first_red;
     uniform float black_level;
-    uniform vec3  wb_gain;
-    uniform float gamma;
     uniform int   cell;
-    uniform int   rotate;
-    uniform float lsc;
 
     out vec4 color;
 
@@ -36,21 +39,36 @@ auto bayer_fragment_shader_source = R"glsl(
         }
         return 0.25 * (fetch(ox, oy) + fetch(ox + 1, oy) + fetch(ox, oy + 1) + fetch(ox + 1, oy + 1));
     }
+)glsl";
 
-    void main(void) {
+// full pipeline for one output position, shared by the display and nv12 passes
+auto bayer_debayer_source = R"glsl(
+    uniform vec3      wb_gain;
+    uniform mat3      ccm;
+    uniform int       rotate;
+    uniform sampler2D tone_lut; // N x 1, output of the tone curve
+    uniform sampler2D lsc_lut;  // shading gain over the sensor
+
+    float tone(float x) {
+        float n = float(textureSize(tone_lut, 0).x);
+        return texture(tone_lut, vec2(x * (n - 1.0) / n + 0.5 / n, 0.5)).r;
+    }
+
+    // pos is in the rotated output image, (0,0) = top left
+    vec3 debayer(vec2 pos) {
         vec2 uv;
         switch(rotate) {
             case 0:
-                uv = tex_coordinate; // 0
+                uv = pos; // 0
                 break;
             case 1:
-                uv = vec2(tex_coordinate.y, 1.0 - tex_coordinate.x); // 90 CW
+                uv = vec2(pos.y, 1.0 - pos.x); // 90 CW
                 break;
             case 2:
-                uv = vec2(1.0 - tex_coordinate.x, 1.0 - tex_coordinate.y); // 180
+                uv = vec2(1.0 - pos.x, 1.0 - pos.y); // 180
                 break;
             case 3:
-                uv = vec2(1.0 - tex_coordinate.y, tex_coordinate.x); // 270 CW
+                uv = vec2(1.0 - pos.y, pos.x); // 270 CW
                 break;
         }
 
@@ -73,60 +91,268 @@ auto bayer_fragment_shader_source = R"glsl(
 
         rgb = rgb - vec3(black_level);
 
-        vec2  d   = (uv - 0.5) * img_size;
-        float r2  = dot(d, d) / dot(0.5 * img_size, 0.5 * img_size);
-        rgb *= 1.0 + lsc * r2;
-
+        rgb *= texture(lsc_lut, uv).r;
         rgb = rgb * wb_gain;
+        rgb = ccm * rgb;
         rgb = clamp(rgb, 0.0, 1.0);
-        rgb = pow(rgb, vec3(gamma));
-        color = vec4(rgb, 1.0);
+        return vec3(tone(rgb.r), tone(rgb.g), tone(rgb.b));
     }
 )glsl";
 
-class BayerShader : public gawl::impl::GraphicShader {
-  public:
-    std::array<float, 2> img_size = {0, 0};
+auto bayer_fragment_shader_source = R"glsl(
+    void main(void) {
+        color = vec4(debayer(tex_coordinate), 1.0);
+    }
+)glsl";
+
+// writes one plane of NV12 (BT.601 limited range) straight from the raw image
+auto bayer_nv12_shader_source = R"glsl(
+    uniform ivec2 out_size; // rotated image size, smaller than the plane when padded
+    uniform int   plane;    // 0 = Y, 1 = UV
 
+    vec3 at(int x, int y) {
+        x = clamp(x, 0, out_size.x - 1);
+        y = clamp(y, 0, out_size.y - 1);
+        return debayer((vec2(x, y) + 0.5) / vec2(out_size));
+    }
+
+    void main(void) {
+        int dx = int(gl_FragCoord.x);
+        int dy = int(gl_FragCoord.y); // row 0 is the first row of the plane
+        if(plane == 0) {
+            float y = dot(at(dx, dy), vec3(0.299, 0.587, 0.114));
+            color   = vec4(y * 0.858824 + 0.062745, 0.0, 0.0, 1.0);
+        } else {
+            int  sx = dx * 2;
+            int  sy = dy * 2;
+            vec3 a  = 0.25 * (at(sx, sy) + at(sx + 1, sy) + at(sx, sy + 1) + at(sx + 1, sy + 1));
+            float u = dot(a, vec3(-0.168736, -0.331264, 0.5));
+            float v = dot(a, vec3(0.5, -0.418688, -0.081312));
+            color   = vec4(u * 0.878431 + 0.501961, v * 0.878431 + 0.501961, 0.0, 1.0);
+        }
+    }
+)glsl";
+
+// averages a sparse set of 2x2 quads per output pixel
+auto bayer_stats_shader_source = R"glsl(
+    uniform ivec2 grid;
+
+    void main(void) {
+        const int samples = 8;
+
+        ivec2 quads = ivec2(img_size / float(cell * 2));
+        ivec2 g     = ivec2(tex_coordinate * vec2(grid));
+        ivec2 begin = g * quads / grid;
+        ivec2 span  = max((g + 1) * quads / grid - begin, ivec2(1));
+        ivec2 red   = ivec2(bayer_first_red);
+
+        vec3  sum = vec3(0.0);
+        float sat = 0.0;
+        for(int j = 0; j < samples; j += 1) {
+            for(int i = 0; i < samples; i += 1) {
+                ivec2 q = (begin + span * ivec2(i, j) / samples) * 2;
+                float r = cell_val(q.x + red.x, q.y + red.y);
+                float b = cell_val(q.x + 1 - red.x, q.y + 1 - red.y);
+                float g = 0.5 * (cell_val(q.x + 1 - red.x, q.y + red.y) + cell_val(q.x + red.x, q.y + 1 - red.y));
+                sum += vec3(r, g, b);
+                sat += max(r, max(g, b)) > 0.98 ? 1.0 : 0.0;
+            }
+        }
+        const float n = float(samples * samples);
+        color = vec4(max(sum / n - vec3(black_level), 0.0), sat / n);
+    }
+)glsl";
+
+constexpr auto tone_lut_size  = 4096;
+constexpr auto lsc_lut_width  = 32;
+constexpr auto lsc_lut_height = 24;
+
+// lookup tables, rebuilt only when their inputs change
+struct {
+    GLuint               tone_lut     = 0;
+    GLuint               lsc_lut      = 0;
+    float                lut_gamma    = -1;
+    float                lut_lsc      = -1;
+    std::array<float, 2> lut_img_size = {0, 0};
+
+    auto create() -> void {
+        for(const auto tex : {&tone_lut, &lsc_lut}) {
+            glGenTextures(1, tex);
+            glBindTexture(GL_TEXTURE_2D, *tex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // binds the tables to texture units 1 and 2
+    auto update(const std::array<float, 2>& img_size) -> void {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, tone_lut);
+        if(lut_gamma != bayer_params.gamma) {
+            lut_gamma = bayer_params.gamma;
+            auto lut  = std::array<uint16_t, tone_lut_size>();
+            for(auto i = 0uz; i < lut.size(); i += 1) {
+                lut[i] = std::pow(1.0 * i / (lut.size() - 1), lut_gamma) * 0xFFFF;
+            }
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, lut.size(), 1, 0, GL_RED, GL_UNSIGNED_SHORT, lut.data());
+        }
+
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, lsc_lut);
+        if(lut_lsc != bayer_params.lsc || lut_img_size != img_size) {
+            lut_lsc      = bayer_params.lsc;
+            lut_img_size = img_size;
+            // radial falloff, measured in pixels so that non-square sensors stay circular
+            const auto [w, h] = img_size;
+            auto lut          = std::array<float, lsc_lut_width * lsc_lut_height>();
+            for(auto y = 0; y < lsc_lut_height; y += 1) {
+                for(auto x = 0; x < lsc_lut_width; x += 1) {
+                    const auto dx = ((x + 0.5f) / lsc_lut_width - 0.5f) * w;
+                    const auto dy = ((y + 0.5f) / lsc_lut_height - 0.5f) * h;
+                    const auto r2 = (dx * dx + dy * dy) / (w * w / 4 + h * h / 4);
+
+                    lut[y * lsc_lut_width + x] = 1.0f + lut_lsc * r2;
+                }
+            }
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, lsc_lut_width, lsc_lut_height, 0, GL_RED, GL_FLOAT, lut.data());
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+    }
+} luts;
+
+// uniforms of bayer_debayer_source, for any program that links it
+struct DebayerUniforms {
     GLint loc_img_size  = -1;
     GLint loc_first_red = -1;
     GLint loc_black     = -1;
     GLint loc_wb        = -1;
-    GLint loc_gamma     = -1;
+    GLint loc_ccm       = -1;
     GLint loc_cell      = -1;
     GLint loc_rotate    = -1;
-    GLint loc_lsc       = -1;
+    GLint loc_tone_lut  = -1;
+    GLint loc_lsc_lut   = -1;
 
-    auto cache_locations() -> void {
-        const auto p  = get_shader();
+    auto cache_locations(const GLuint p) -> void {
         loc_img_size  = glGetUniformLocation(p, "img_size");
         loc_first_red = glGetUniformLocation(p, "bayer_first_red");
         loc_black     = glGetUniformLocation(p, "black_level");
         loc_wb        = glGetUniformLocation(p, "wb_gain");
-        loc_gamma     = glGetUniformLocation(p, "gamma");
+        loc_ccm       = glGetUniformLocation(p, "ccm");
         loc_cell      = glGetUniformLocation(p, "cell");
         loc_rotate    = glGetUniformLocation(p, "rotate");
-        loc_lsc       = glGetUniformLocation(p, "lsc_strength");
+        loc_tone_lut  = glGetUniformLocation(p, "tone_lut");
+        loc_lsc_lut   = glGetUniformLocation(p, "lsc_lut");
     }
 
-    auto set_parameters(GLuint /*program*/) -> void override {
+    // the program must be in use
+    auto apply(const std::array<float, 2>& img_size) const -> void {
+        luts.update(img_size);
         glUniform2fv(loc_img_size, 1, img_size.data());
         glUniform2fv(loc_first_red, 1, bayer_params.first_red.data());
         glUniform1f(loc_black, bayer_params.black_level);
         glUniform3fv(loc_wb, 1, bayer_params.wb_gain.data());
-        glUniform1f(loc_gamma, bayer_params.gamma);
+        glUniformMatrix3fv(loc_ccm, 1, GL_TRUE, bayer_params.ccm.data());
         glUniform1i(loc_cell, bayer_params.cell);
         glUniform1i(loc_rotate, bayer_params.rotate);
-        glUniform1f(loc_lsc, bayer_params.lsc);
+        glUniform1i(loc_tone_lut, 1);
+        glUniform1i(loc_lsc_lut, 2);
     }
 };
 
+class BayerShader : public gawl::impl::GraphicShader {
+  public:
+    std::array<float, 2> img_size = {0, 0};
+    DebayerUniforms      uniforms;
+
+    auto set_parameters(GLuint /*program*/) -> void override {
+        uniforms.apply(img_size);
+    }
+};
+
+struct {
+    GLuint          prog         = 0;
+    DebayerUniforms uniforms;
+    GLint           loc_out_size = -1;
+    GLint           loc_plane    = -1;
+} nv12_shader;
+
+struct {
+    GLuint prog          = 0;
+    GLint  loc_img_size  = -1;
+    GLint  loc_first_red = -1;
+    GLint  loc_black     = -1;
+    GLint  loc_cell      = -1;
+    GLint  loc_grid      = -1;
+} stats_shader;
+
 auto shader = BayerShader();
 } // namespace
 
+auto load_color_profile(const char* const path, BayerParams& params) -> bool {
+    auto file = std::ifstream(path);
+    ensure(file, "failed to open color profile {}", path);
+
+    auto line = std::string();
+    for(auto num = 1; std::getline(file, line); num += 1) {
+        if(const auto comment = line.find('#'); comment != line.npos) {
+            line.resize(comment);
+        }
+        auto stream = std::istringstream(line);
+        auto key    = std::string();
+        if(!(stream >> key)) {
+            continue;
+        }
+        const auto read = [&stream](std::span<float> values) -> bool {
+            for(auto& v : values) {
+                ensure(stream >> v);
+            }
+            return true;
+        };
+        if(key == "black_level") {
+            ensure(read({&params.black_level, 1}), "{}:{}: expected 1 value", path, num);
+        } else if(key == "wb_gain") {
+            ensure(read(params.wb_gain), "{}:{}: expected 3 values", path, num);
+        } else if(key == "gamma") {
+            ensure(read({&params.gamma, 1}), "{}:{}: expected 1 value", path, num);
+        } else if(key == "lsc") {
+            ensure(read({&params.lsc, 1}), "{}:{}: expected 1 value", path, num);
+        } else if(key == "ccm") {
+            ensure(read(params.ccm), "{}:{}: expected 9 values", path, num);
+        } else {
+            bail("{}:{}: unknown key {}", path, num, key);
+        }
+    }
+    return true;
+}
+
 auto init_bayer_shader() -> bool {
-    ensure(shader.init(gawl::impl::graphic_vertex_shader_source, bayer_fragment_shader_source));
-    shader.cache_locations();
+    const auto display_source = std::string("#version 330 core\n") + bayer_common_source + bayer_debayer_source + bayer_fragment_shader_source;
+    ensure(shader.init(gawl::impl::graphic_vertex_shader_source, display_source.data()));
+    shader.uniforms.cache_locations(shader.get_shader());
+    luts.create();
+
+    const auto nv12_source = std::string("#version 130\n") + bayer_common_source + bayer_debayer_source + bayer_nv12_shader_source;
+    unwrap(nv12_prog, compile_program(fullscreen_vertex_shader_source, nv12_source.data()));
+    nv12_shader.prog = nv12_prog;
+    nv12_shader.uniforms.cache_locations(nv12_prog);
+    nv12_shader.loc_out_size = glGetUniformLocation(nv12_prog, "out_size");
+    nv12_shader.loc_plane    = glGetUniformLocation(nv12_prog, "plane");
+
+    const auto stats_source = std::string("#version 130\n") + bayer_common_source + bayer_stats_shader_source;
+    unwrap(prog, compile_program(fullscreen_vertex_shader_source, stats_source.data()));
+    stats_shader.prog          = prog;
+    stats_shader.loc_img_size  = glGetUniformLocation(prog, "img_size");
+    stats_shader.loc_first_red = glGetUniformLocation(prog, "bayer_first_red");
+    stats_shader.loc_black     = glGetUniformLocation(prog, "black_level");
+    stats_shader.loc_cell      = glGetUniformLocation(prog, "cell");
+    stats_shader.loc_grid      = glGetUniformLocation(prog, "grid");
     return true;
 }
 
@@ -142,6 +368,50 @@ auto BayerGraphic::update_texture(const int width, const int height, const int s
     ::shader.img_size = {GLfloat(width), GLfloat(height)};
 }
 
+auto BayerGraphic::draw_stats(const int grid_width, const int grid_height) -> void {
+    glUseProgram(stats_shader.prog);
+    glActiveTexture(GL_TEXTURE0);
+    const auto txbinder = bind_texture();
+    glUniform1i(glGetUniformLocation(stats_shader.prog, "tex_0"), 0);
+    glUniform2f(stats_shader.loc_img_size, GLfloat(width), GLfloat(height));
+    glUniform2fv(stats_shader.loc_first_red, 1, bayer_params.first_red.data());
+    glUniform1f(stats_shader.loc_black, bayer_params.black_level);
+    glUniform1i(stats_shader.loc_cell, bayer_params.cell);
+    glUniform2i(stats_shader.loc_grid, grid_width, grid_height);
+    draw_fullscreen(stats_shader.prog);
+    glUseProgram(0);
+}
+
+auto BayerGraphic::draw_nv12(const GLuint fbo_y, const GLuint fbo_uv, const int plane_width, const int plane_height) -> void {
+    auto out_size = std::array{width, height};
+    if(bayer_params.rotate % 2 != 0) {
+        std::swap(out_size[0], out_size[1]);
+    }
+
+    glUseProgram(nv12_shader.prog);
+    nv12_shader.uniforms.apply({GLfloat(width), GLfloat(height)});
+    glActiveTexture(GL_TEXTURE0);
+    const auto txbinder = bind_texture();
+    glUniform1i(glGetUniformLocation(nv12_shader.prog, "tex_0"), 0);
+    glUniform2i(nv12_shader.loc_out_size, out_size[0], out_size[1]);
+
+    auto viewport = std::array<GLint, 4>();
+    glGetIntegerv(GL_VIEWPORT, viewport.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_y);
+    glViewport(0, 0, plane_width, plane_height);
+    glUniform1i(nv12_shader.loc_plane, 0);
+    draw_fullscreen(nv12_shader.prog);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_uv);
+    glViewport(0, 0, plane_width / 2, plane_height / 2);
+    glUniform1i(nv12_shader.loc_plane, 1);
+    draw_fullscreen(nv12_shader.prog);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
 BayerGraphic::BayerGraphic()
     : GraphicBase(::shader) {
 }
@@ -9,22 +9,32 @@
 // Bayer order, expressed as the position of the first red pixel.
 // SRGGB -> (0,0), SGRBG -> (1,0), SGBRG -> (0,1), SBGGR -> (1,1).
 struct BayerParams {
-    std::array<float, 2> first_red   = {0.0f, 0.0f};          // SRGGB10P
-    float                black_level = 16.0f / 255.0f;        // 10-bit 64 -> 8-bit MSB
-    std::array<float, 3> wb_gain     = {1.70f, 1.07f, 1.60f}; // R,G,B gain (incl. normalize)
-    float                gamma       = 1.0f / 2.2f;           // shader applies pow(rgb, gamma)
-    int                  cell        = 1;                     // 1=standard bayer, 2=quad bayer (2x2 binned)
-    int                  rotate      = 0;                     // clockwise output rotation: 0/1/2/3 = 0/90/180/270 deg
-    float                lsc         = 0.0f;                  // lens shading correction: 0=off, radial gain at corner = 1+strength
+    std::array<float, 2> first_red   = {0.0f, 0.0f};                // SRGGB10P
+    float                black_level = 16.0f / 255.0f;              // 10-bit 64 -> 8-bit MSB
+    std::array<float, 3> wb_gain     = {1.70f, 1.07f, 1.60f};       // R,G,B gain (incl. normalize)
+    float                gamma       = 1.0f / 2.2f;                 // tone curve pow(rgb, gamma), baked into a lut
+    int                  cell        = 1;                           // 1=standard bayer, 2=quad bayer (2x2 binned)
+    int                  rotate      = 0;                           // clockwise output rotation: 0/1/2/3 = 0/90/180/270 deg
+    float                lsc         = 0.0f;                        // lens shading correction: 0=off, radial gain at corner = 1+strength
+    std::array<float, 9> ccm         = {1, 0, 0, 0, 1, 0, 0, 0, 1}; // row major camera rgb -> srgb, applied after wb
 };
 
 inline auto bayer_params = BayerParams();
 
+// text file with one "key value..." per line, '#' starts a comment
+// keys: black_level, wb_gain (r g b), gamma, lsc, ccm (9 values, row major)
+auto load_color_profile(const char* path, BayerParams& params) -> bool;
+
 auto init_bayer_shader() -> bool;
 
 class BayerGraphic : public gawl::impl::GraphicBase {
   public:
     auto update_texture(int width, int height, int stride, const std::byte* data) -> void;
+    // render 3a statistics of the raw image into the bound framebuffer, one pixel per grid block
+    auto draw_stats(int grid_width, int grid_height) -> void;
+    // debayer straight into nv12 luma (R8) and chroma (GR88) render targets
+    // the image is placed at the top left, padding repeats the edge pixels
+    auto draw_nv12(GLuint fbo_y, GLuint fbo_uv, int plane_width, int plane_height) -> void;
 
     BayerGraphic();
 };
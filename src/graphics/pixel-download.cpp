@@ -0,0 +1,61 @@
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "pixel-download.hpp"
+
+auto PixelDownload::read(const int width, const int height, const GLenum format, const size_t offset, const GLenum type) -> void {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, format, type, reinterpret_cast<void*>(offset));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+auto PixelDownload::submit() -> void {
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+}
+
+auto PixelDownload::is_ready() -> bool {
+    return glClientWaitSync(fence, 0, 0) != GL_TIMEOUT_EXPIRED;
+}
+
+auto PixelDownload::wait() -> void {
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+}
+
+auto PixelDownload::map() -> const std::byte* {
+    if(mapped == nullptr) {
+        auto size = GLint64(0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glGetBufferParameteri64v(GL_PIXEL_PACK_BUFFER, GL_BUFFER_SIZE, &size);
+        mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    return static_cast<const std::byte*>(mapped);
+}
+
+auto PixelDownload::recycle() -> void {
+    if(mapped != nullptr) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        mapped = nullptr;
+    }
+    if(fence != nullptr) {
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+}
+
+PixelDownload::PixelDownload(const size_t size) {
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+PixelDownload::~PixelDownload() {
+    recycle();
+    glDeleteBuffers(1, &pbo);
+}
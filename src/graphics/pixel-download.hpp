@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+
+#include <GL/gl.h>
+
+// asynchronous gpu to cpu transfer through a pixel pack buffer
+class PixelDownload {
+  private:
+    GLuint pbo    = 0;
+    GLsync fence  = nullptr;
+    void*  mapped = nullptr;
+
+  public:
+    // read from the currently bound framebuffer into the buffer at offset
+    auto read(int width, int height, GLenum format, size_t offset, GLenum type = GL_UNSIGNED_BYTE) -> void;
+    // insert a fence after all reads were issued
+    auto submit() -> void;
+    // non-blocking
+    auto is_ready() -> bool;
+    auto wait() -> void;
+    // must be ready, the mapping is valid until recycle() or destruction
+    auto map() -> const std::byte*;
+    // unmaps and drops the fence, so that the buffer can be read into again
+    auto recycle() -> void;
+
+    PixelDownload(const PixelDownload&) = delete;
+    PixelDownload(size_t size);
+    ~PixelDownload();
+};
@@ -0,0 +1,100 @@
+#include <array>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../macros/unwrap.hpp"
+#include "program.hpp"
+
+namespace {
+auto compile(const GLenum type, const char* const src) -> std::optional<GLuint> {
+    const auto s = glCreateShader(type);
+    glShaderSource(s, 1, &src, nullptr);
+    glCompileShader(s);
+    auto ok = GLint(0);
+    glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+    if(!ok) {
+        auto log = std::array<char, 2048>();
+        glGetShaderInfoLog(s, log.size(), nullptr, log.data());
+        glDeleteShader(s);
+        bail("failed to compile shader: {}", log.data());
+    }
+    return s;
+}
+
+// created on first use, every offscreen pass runs in the capture thread's context
+struct {
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLuint ebo = 0;
+} quad;
+} // namespace
+
+const char* const fullscreen_vertex_shader_source = R"glsl(
+    #version 130
+    in vec2  position;
+    in vec2  texcoord;
+    out vec2 tex_coordinate;
+    void main() {
+        gl_Position    = vec4(position, 0.0, 1.0);
+        tex_coordinate = texcoord;
+    }
+)glsl";
+
+auto compile_program(const char* const vertex_source, const char* const fragment_source) -> std::optional<GLuint> {
+    unwrap(vertex_shader, compile(GL_VERTEX_SHADER, vertex_source));
+    unwrap(fragment_shader, compile(GL_FRAGMENT_SHADER, fragment_source));
+    const auto prog = glCreateProgram();
+    glAttachShader(prog, vertex_shader);
+    glAttachShader(prog, fragment_shader);
+    glLinkProgram(prog);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    auto ok = GLint(0);
+    glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+    if(!ok) {
+        auto log = std::array<char, 2048>();
+        glGetProgramInfoLog(prog, log.size(), nullptr, log.data());
+        glDeleteProgram(prog);
+        bail("failed to link program: {}", log.data());
+    }
+    return prog;
+}
+
+auto draw_fullscreen(const GLuint program) -> void {
+    constexpr GLfloat verts[] = {-1, -1, 0, 0, 1, -1, 1, 0, 1, 1, 1, 1, -1, 1, 0, 1};
+    constexpr GLuint  elems[] = {0, 1, 2, 2, 3, 0};
+
+    // leave gawl's bindings as they were
+    auto prev_vao = GLint(0);
+    auto prev_vbo = GLint(0);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &prev_vao);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &prev_vbo);
+
+    if(quad.vao == 0) {
+        glGenVertexArrays(1, &quad.vao);
+        glGenBuffers(1, &quad.vbo);
+        glGenBuffers(1, &quad.ebo);
+        glBindVertexArray(quad.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, quad.vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad.ebo); // part of the vao state
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(elems), elems, GL_STATIC_DRAW);
+    }
+
+    const auto pos = glGetAttribLocation(program, "position");
+    const auto tc  = glGetAttribLocation(program, "texcoord");
+    glBindVertexArray(quad.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, quad.vbo);
+    glVertexAttribPointer(pos, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, nullptr);
+    glEnableVertexAttribArray(pos);
+    glVertexAttribPointer(tc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, reinterpret_cast<void*>(sizeof(GLfloat) * 2));
+    glEnableVertexAttribArray(tc);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
+    glDisableVertexAttribArray(pos);
+    glDisableVertexAttribArray(tc);
+
+    glBindVertexArray(prev_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, prev_vbo);
+}
@@ -0,0 +1,13 @@
+// helpers for offscreen passes that do not go through gawl
+
+#pragma once
+#include <optional>
+
+#include <GL/gl.h>
+
+// vertex shader covering the viewport, passes `tex_coordinate` to the fragment shader
+extern const char* const fullscreen_vertex_shader_source;
+
+auto compile_program(const char* vertex_source, const char* fragment_source) -> std::optional<GLuint>;
+// program must be in use
+auto draw_fullscreen(GLuint program) -> void;
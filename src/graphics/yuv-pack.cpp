@@ -0,0 +1,130 @@
+#include <string>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../macros/unwrap.hpp"
+#include "program.hpp"
+#include "yuv-pack.hpp"
+
+namespace {
+auto fragment_shader_source = R"glsl(
+    in vec2           tex_coordinate;
+    uniform sampler2D src;
+    uniform ivec2     src_size;
+    uniform ivec2     dst_size;
+    uniform int       plane; // 0 = Y, 1 = Cb, 2 = Cr
+    out vec4          color;
+
+    vec3 fetch(int x, int y) {
+        x = clamp(x, 0, src_size.x - 1);
+        y = clamp(y, 0, src_size.y - 1);
+        return texelFetch(src, ivec2(x, src_size.y - 1 - y), 0).rgb; // flip vertical
+    }
+
+    void main() {
+        int dx = int(tex_coordinate.x * float(dst_size.x));
+        int dy = int(tex_coordinate.y * float(dst_size.y));
+        if(plane == 0) {
+            color = vec4(dot(fetch(dx, dy), vec3(0.299, 0.587, 0.114)), 0.0, 0.0, 1.0);
+            return;
+        }
+        int  sx = dx * 2;
+        int  sy = dy * 2;
+        vec3 a  = 0.25 * (fetch(sx, sy) + fetch(sx + 1, sy) + fetch(sx, sy + 1) + fetch(sx + 1, sy + 1));
+        if(plane == 1) {
+            color = vec4(dot(a, vec3(-0.168736, -0.331264, 0.5)) + 0.501961, 0.0, 0.0, 1.0);
+        } else {
+            color = vec4(dot(a, vec3(0.5, -0.418688, -0.081312)) + 0.501961, 0.0, 0.0, 1.0);
+        }
+    }
+)glsl";
+
+struct {
+    GLuint prog        = 0;
+    GLint  loc_src     = -1;
+    GLint  loc_srcsize = -1;
+    GLint  loc_dstsize = -1;
+    GLint  loc_plane   = -1;
+} shader;
+} // namespace
+
+auto init_yuv_pack_shader() -> bool {
+    const auto source = std::string("#version 130\n") + fragment_shader_source;
+    unwrap(prog, compile_program(fullscreen_vertex_shader_source, source.data()));
+    shader.prog        = prog;
+    shader.loc_src     = glGetUniformLocation(prog, "src");
+    shader.loc_srcsize = glGetUniformLocation(prog, "src_size");
+    shader.loc_dstsize = glGetUniformLocation(prog, "dst_size");
+    shader.loc_plane   = glGetUniformLocation(prog, "plane");
+    return true;
+}
+
+auto YUVPacker::plane_size(const int plane) const -> std::array<int, 2> {
+    const auto cw = (width + 1) / 2;
+    const auto ch = (height + 1) / 2;
+    return plane == 0 ? std::array{cw * 2, height} : std::array{cw, ch};
+}
+
+auto YUVPacker::resize(const int width, const int height) -> void {
+    if(width == this->width && height == this->height) {
+        return;
+    }
+    this->width  = width;
+    this->height = height;
+    for(auto i = 0; i < 3; i += 1) {
+        const auto [w, h] = plane_size(i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+auto YUVPacker::render(const GLuint src) -> void {
+    auto viewport = std::array<GLint, 4>();
+    glGetIntegerv(GL_VIEWPORT, viewport.data());
+
+    glUseProgram(shader.prog);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, src);
+    glUniform1i(shader.loc_src, 0);
+    glUniform2i(shader.loc_srcsize, width, height);
+
+    for(auto i = 0; i < 3; i += 1) {
+        const auto [w, h] = plane_size(i);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+        glViewport(0, 0, w, h);
+        glUniform2i(shader.loc_dstsize, w, h);
+        glUniform1i(shader.loc_plane, i);
+        draw_fullscreen(shader.prog);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+auto YUVPacker::get_framebuffer(const int plane) const -> GLuint {
+    return fbos[plane];
+}
+
+YUVPacker::YUVPacker() {
+    glGenTextures(3, textures.data());
+    glGenFramebuffers(3, fbos.data());
+    for(auto i = 0; i < 3; i += 1) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+YUVPacker::~YUVPacker() {
+    glDeleteFramebuffers(3, fbos.data());
+    glDeleteTextures(3, textures.data());
+}
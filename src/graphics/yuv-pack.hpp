@@ -0,0 +1,29 @@
+// render an RGBA texture into 8-bit planar YCbCr 4:2:0 (JFIF full range)
+
+#pragma once
+#include <array>
+
+#include <GL/gl.h>
+
+auto init_yuv_pack_shader() -> bool;
+
+class YUVPacker {
+  private:
+    std::array<GLuint, 3> textures = {};
+    std::array<GLuint, 3> fbos     = {};
+    int                   width  = 0;
+    int                   height = 0;
+
+  public:
+    // reallocates the planes only when the size changed
+    auto resize(int width, int height) -> void;
+    // size of each plane, luma stride is padded to twice the chroma width
+    auto plane_size(int plane) const -> std::array<int, 2>;
+    // source texture is read bottom-up and written top-down
+    auto render(GLuint src) -> void;
+    auto get_framebuffer(int plane) const -> GLuint;
+
+    YUVPacker(const YUVPacker&) = delete;
+    YUVPacker();
+    ~YUVPacker();
+};
@@ -0,0 +1,82 @@
+#include <algorithm>
+
+#include "aaa.hpp"
+
+namespace ipu3 {
+namespace {
+// the awb grid is stored with rows padded to 4 cells
+auto grid_stride(const ipu3_uapi_grid_config& grid) -> int {
+    return (grid.width + 3) & ~3;
+}
+
+template <class F>
+auto for_each_cell(const ipu3_uapi_grid_config& grid, const ipu3_uapi_stats_3a& stats, F f) -> void {
+    const auto stride = grid_stride(grid);
+    for(auto y = 0; y < grid.height; y += 1) {
+        for(auto x = 0; x < grid.width; x += 1) {
+            f(stats.awb_raw_buffer.meta_data[y * stride + x]);
+        }
+    }
+}
+} // namespace
+
+auto AAA::run_ae(const ipu3_uapi_stats_3a& stats) -> void {
+    lumas.clear();
+    auto saturated = 0uz;
+    for_each_cell(grid, stats, [&](const ipu3_uapi_awb_set_item& cell) {
+        const auto g = (cell.Gr_avg + cell.Gb_avg) / 2.0;
+        lumas.push_back((0.299 * cell.R_avg * wb_ratio[0] + 0.587 * g + 0.114 * cell.B_avg * wb_ratio[1]) / 255.0);
+        saturated += cell.sat_ratio > 128 ? 1 : 0;
+    });
+    ae.update(lumas, saturated);
+}
+
+auto AAA::run_awb(const ipu3_uapi_stats_3a& stats) -> void {
+    // gray world over unsaturated cells, like libcamera's ipu3 awb
+    auto sum = std::array{0.0, 0.0, 0.0};
+    auto num = 0uz;
+    auto all = 0uz;
+    for_each_cell(grid, stats, [&](const ipu3_uapi_awb_set_item& cell) {
+        all += 1;
+        const auto g = (cell.Gr_avg + cell.Gb_avg) / 2.0;
+        if(cell.sat_ratio > 0 || g < 4) {
+            return;
+        }
+        sum[0] += cell.R_avg;
+        sum[1] += g;
+        sum[2] += cell.B_avg;
+        num += 1;
+    });
+    if(num * 10 < all || sum[0] <= 0 || sum[2] <= 0) {
+        return;
+    }
+
+    const auto target = std::array{sum[1] / sum[0], sum[1] / sum[2]};
+    for(auto i = 0; i < 2; i += 1) {
+        wb_ratio[i] += (std::clamp(target[i], 0.25, 4.0) - wb_ratio[i]) * 0.2;
+    }
+}
+
+auto AAA::init(const ipu3_uapi_grid_config& grid, V4L2ControlBundle* const sensor, const bool awb) -> void {
+    this->grid = grid;
+    this->awb  = awb;
+    ae.init(sensor);
+}
+
+auto AAA::process(const ipu3_uapi_stats_3a& stats) -> void {
+    if(awb) {
+        run_awb(stats);
+    }
+    run_ae(stats);
+}
+
+auto AAA::apply(ipu3_uapi_params& params) const -> void {
+    if(!awb) {
+        return;
+    }
+    // keep the green gain chosen by the user as the reference
+    auto& gains = params.acc_param.bnr.wb_gains;
+    gains.r     = uint16_t(std::min(gains.gr * wb_ratio[0], 8191.0));
+    gains.b     = uint16_t(std::min(gains.gr * wb_ratio[1], 8191.0));
+}
+} // namespace ipu3
@@ -0,0 +1,28 @@
+#pragma once
+#include <array>
+#include <vector>
+
+#include "../auto-exposure.hpp"
+#include "intel-ipu3.h"
+
+namespace ipu3 {
+// 3a driven by the statistics the imgu computes alongside each frame
+class AAA {
+  private:
+    ipu3_uapi_grid_config grid;
+    AutoExposure          ae;
+    bool                  awb = false;
+    std::vector<float>    lumas;
+    std::array<double, 2> wb_ratio = {1.0, 1.0}; // r and b gain relative to green
+
+    auto run_ae(const ipu3_uapi_stats_3a& stats) -> void;
+    auto run_awb(const ipu3_uapi_stats_3a& stats) -> void;
+
+  public:
+    // sensor is null if auto exposure is disabled
+    auto init(const ipu3_uapi_grid_config& grid, V4L2ControlBundle* sensor, bool awb) -> void;
+    auto process(const ipu3_uapi_stats_3a& stats) -> void;
+    // writes the current white balance gains, params must not be queued to the imgu
+    auto apply(ipu3_uapi_params& params) const -> void;
+};
+} // namespace ipu3
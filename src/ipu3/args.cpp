@@ -49,10 +49,15 @@ auto Args::parse(const int argc, const char* const* const argv) -> std::optional
     parser.kwarg(&args.sensor_width, {"--sensor-width"}, "WIDTH", "device profile");
     parser.kwarg(&args.sensor_height, {"--sensor-height"}, "HEIGHT", "device profile");
     parser.kwarg(&args.ipu3_params, {"--params"}, "KEY=VALUE,...", "ipu3 parameter, wb_gains.r, gamma, etc.", {.state = args::State::Initialized});
+    parser.kwflag(&args.ae, {"--ae"}, "enable auto exposure");
+    parser.kwflag(&args.awb, {"--awb"}, "enable auto white balance");
     if(!parser.parse(argc, argv) || args.help) {
         std::println("usage: wlcam-ipu3 {}", parser.get_help());
         exit(0);
     }
+    ensure(resolve_common_args(args));
+    ensure(!args.copy_video, "--video-codec copy needs an mjpeg camera");
+    ensure(!args.raw_video, "--video-codec raw is not supported");
     return args;
 }
 } // namespace ipu3
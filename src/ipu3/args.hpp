@@ -16,6 +16,8 @@ struct Args : CommonArgs {
     int         sensor_width;
     int         sensor_height;
     Params      ipu3_params;
+    bool        ae  = false;
+    bool        awb = false;
 
     static auto parse(int argc, const char* const* argv) -> std::optional<Args>;
 };
@@ -1,3 +1,4 @@
+#include <future>
 #include <thread>
 
 #include <linux/v4l2-subdev.h>
@@ -6,12 +7,16 @@
 #include "../gawl/wayland/application.hpp"
 #include "../macros/unwrap.hpp"
 #include "../media-device.hpp"
+#include "../photo-saver.hpp"
 #include "../record-context.hpp"
 #include "../timer.hpp"
 #include "../udev.hpp"
+#include "../ui-v4l2.hpp"
 #include "../util/event.hpp"
+#include "../v4l2-encoder/encoder.hpp"
 #include "../v4l2.hpp"
 #include "../window.hpp"
+#include "aaa.hpp"
 #include "algorithm.hpp"
 #include "args.hpp"
 #include "cio2.hpp"
@@ -23,6 +28,11 @@
 auto running       = false;
 auto camera_thread = std::thread();
 
+struct BuiltRecordContext {
+    std::unique_ptr<RecordContext>   context;
+    std::unique_ptr<ff::V4L2Encoder> encoder; // --video-codec v4l2-*
+};
+
 class IPU3WindowCallbacks : public WindowCallbacks {
   public:
     Event window_ready;
@@ -117,7 +127,6 @@ auto main(const int argc, const char* const argv[]) -> int {
     unwrap(imgu_parameter_buffers, v4l2::query_and_export_buffers(imgu_param_fd, outbuf_meta, imgu_parameters_req));
     unwrap(imgu_stat_req, v4l2::request_buffers(imgu_stat_fd, capbuf_meta, V4L2_MEMORY_MMAP, num_buffers));
     unwrap(imgu_stat_buffers, v4l2::query_and_export_buffers(imgu_stat_fd, capbuf_meta, imgu_stat_req));
-    (void)imgu_stat_buffers; // status feedback is not implemented
 
     unwrap(imgu_output_req, v4l2::request_buffers(imgu_output_fd, capbuf_mp, V4L2_MEMORY_MMAP, num_buffers));
     unwrap(imgu_output_buffers, v4l2::query_and_export_buffers_mp(imgu_output_fd, capbuf_mp, imgu_output_req));
@@ -174,28 +183,120 @@ auto main(const int argc, const char* const argv[]) -> int {
     }
     params_buffers = params_mmap_ptrs; // for params.cpp
 
+    auto stat_mmaps = std::array<v4l2::Buffer, num_buffers>(); // unmapped on exit
+    for(auto i = 0u; i < num_buffers; i += 1) {
+        const auto ptr = mmap(NULL, imgu_stat_buffers[i].length,
+                              PROT_READ,
+                              MAP_SHARED, imgu_stat_buffers[i].fd.as_handle(), 0);
+        ensure(ptr != MAP_FAILED, "errno={}", errno);
+        stat_mmaps[i].start  = ptr;
+        stat_mmaps[i].length = imgu_stat_buffers[i].length;
+    }
+
+    // 3a
+    auto sensor_controls = V4L2ControlBundle{
+        .fd    = cio2_sensor_fd,
+        .ctrls = v4l2::query_controls(cio2_sensor_fd),
+    };
+    auto aaa = ipu3::AAA();
+    aaa.init(bds_grid, args.ae ? &sensor_controls : nullptr, args.awb);
+
     // prepare gui
     auto app = gawl::WaylandApplication();
     ensure(init_yuv420sp_shader());
     auto viewfinder_cbs = std::shared_ptr<IPU3WindowCallbacks>(new IPU3WindowCallbacks());
     create_buttons(viewfinder_cbs->buttons, args.ipu3_params);
+    // separate from the auto exposure's copy, which is written by the camera thread
+    auto ui_controls = V4L2ControlBundle{
+        .fd    = cio2_sensor_fd,
+        .ctrls = v4l2::query_controls(cio2_sensor_fd),
+    };
+    if(args.ae) {
+        std::erase_if(ui_controls.ctrls, [](const v4l2::Control& ctrl) { return ctrl.id == V4L2_CID_EXPOSURE || ctrl.id == V4L2_CID_ANALOGUE_GAIN; });
+    }
+    build_buttons_from_controls(ui_controls, viewfinder_cbs->buttons);
 
     running       = true;
     camera_thread = std::thread([&]() -> bool {
         constexpr auto error_value = false;
 
         viewfinder_cbs->window_ready.wait();
-        auto&      context        = viewfinder_cbs->get_context();
-        auto       window_context = viewfinder_cbs->get_window()->fork_context();
-        auto       record_context = std::unique_ptr<RecordContext>();
-        const auto output_width   = imgu_output_fmt.fmt.pix_mp.width;
-        const auto output_height  = imgu_output_fmt.fmt.pix_mp.height;
-        const auto output_stride  = imgu_output_fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
-        const auto vf_width       = imgu_vf_fmt.fmt.pix_mp.width;
-        const auto vf_height      = imgu_vf_fmt.fmt.pix_mp.height;
-        const auto vf_stride      = imgu_vf_fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
-        auto       ubuf           = std::vector<std::byte>(output_height / 4 * output_width);
-        auto       vbuf           = std::vector<std::byte>(output_height / 4 * output_width);
+        auto&      context         = viewfinder_cbs->get_context();
+        auto       window_context  = viewfinder_cbs->get_window()->fork_context();
+        auto       record_context  = std::unique_ptr<RecordContext>();
+        auto       v4l2_encoder    = std::unique_ptr<ff::V4L2Encoder>(); // --video-codec v4l2-*
+        const auto output_width    = imgu_output_fmt.fmt.pix_mp.width;
+        const auto output_height   = imgu_output_fmt.fmt.pix_mp.height;
+        const auto output_stride   = imgu_output_fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+        const auto vf_width        = imgu_vf_fmt.fmt.pix_mp.width;
+        const auto vf_height       = imgu_vf_fmt.fmt.pix_mp.height;
+        const auto vf_stride       = imgu_vf_fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+        auto       ubuf            = std::vector<std::byte>(output_height / 4 * output_width);
+        auto       vbuf            = std::vector<std::byte>(output_height / 4 * output_width);
+        auto       preroll_pending = args.preroll > 0; // --preroll, start encoding on the next frame
+        auto       burst           = Burst();
+        auto       photo_saver     = PhotoSaver();
+        photo_saver.init(0, size_t(args.burst_mbytes) * 1024 * 1024);
+
+        // picked once at startup, the benchmark takes seconds per node and runs aside while the camera starts
+        const auto encoder_node = !args.use_v4l2_encoder
+                                      ? std::shared_future<std::optional<std::string>>()
+                                      : std::async(std::launch::async, [&]() {
+                                            return ff::select_v4l2_encoder(output_width, output_height, args.encoder_config, false);
+                                        }).share();
+
+        // the codec setup takes a while, safe to run off the camera thread
+        const auto build_record_context = [&](const AVPixelFormat pix_fmt, std::string path, const int fps, const bool standby) -> std::optional<BuiltRecordContext> {
+            auto rc     = std::unique_ptr<RecordContext>(new RecordContext());
+            auto enc    = std::unique_ptr<ff::V4L2Encoder>();
+            rc->standby = standby;
+            if(args.use_v4l2_encoder) {
+                static_assert(num_buffers <= ff::V4L2Encoder::max_imports);
+                unwrap(node, encoder_node.get());
+                // the imgu output is imported as is when the encoder accepts its layout
+                enc = std::make_unique<ff::V4L2Encoder>();
+                ensure(enc->init_cpu(node.data(), output_width, output_height, fps, args.encoder_config, output_stride, imgu_output_buffers[0].length));
+                ensure(rc->init(std::move(path), output_width, output_height, enc->coded_width(), enc->coded_height(), args));
+            } else {
+                ensure(rc->init(std::move(path), pix_fmt, output_width, output_height, fps, args));
+            }
+            return BuiltRecordContext{std::move(rc), std::move(enc)};
+        };
+
+        const auto create_record_context = [&](const Frame& frame, std::string path, const bool standby) -> bool {
+            unwrap(pix_fmt, frame.get_pixel_format());
+            const auto fps = context.capture_rate > 0 ? context.capture_rate : 30;
+            unwrap_mut(built, build_record_context(pix_fmt, std::move(path), fps, standby));
+            record_context = std::move(built.context);
+            v4l2_encoder   = std::move(built.encoder);
+            return true;
+        };
+
+        // movie mode builds its idle encoder in the background, the camera keeps running meanwhile
+        auto       standby        = std::future<std::optional<BuiltRecordContext>>();
+        auto       standby_failed = false; // not retried until movie mode is entered again
+        const auto adopt_standby  = [&]() -> void {
+            auto built = standby.get();
+            if(!built) {
+                WARN("failed to create the standby encoder, recording will start cold");
+                standby_failed = true;
+                return;
+            }
+            record_context = std::move(built->context);
+            v4l2_encoder   = std::move(built->encoder);
+        };
+
+        const auto stop_recording = [&]() -> bool {
+            if(v4l2_encoder) {
+                ensure(v4l2_encoder->drain([&](ff::V4L2Encoder::Packet& p) {
+                    record_context->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+                }));
+                v4l2_encoder.reset();
+            }
+            record_context.reset();
+            preroll_pending = args.preroll > 0;
+            return true;
+        };
 
         std::println("ipu3 sensor {}", cio2_0.sensor.dev_node);
         if(cio2_0.sensor.lens) {
@@ -213,8 +314,13 @@ auto main(const int argc, const char* const argv[]) -> int {
         unwrap_v(i, v4l2::dequeue_buffer_mp(cio2_output_fd, capbuf_mp, V4L2_MEMORY_DMABUF));
 
         // start processing
+        if(v4l2_encoder && v4l2_encoder->can_import()) {
+            // the encoder may still be reading the previous frame in this buffer
+            v4l2_encoder->wait_released(i);
+        }
         ensure_v(v4l2::queue_buffer_mp(imgu_output_fd, capbuf_mp, V4L2_MEMORY_DMABUF, i, &imgu_output_buffers[i], 1));
         ensure_v(v4l2::queue_buffer_mp(imgu_vf_fd, capbuf_mp, V4L2_MEMORY_DMABUF, i, &imgu_vf_buffers[i], 1));
+        aaa.apply(*params_buffers[i]); // dequeued in the previous round
         ensure_v(v4l2::queue_buffer(imgu_param_fd, outbuf_meta, i));
         ensure_v(v4l2::queue_buffer(imgu_stat_fd, capbuf_meta, i));
         ensure_v(v4l2::queue_buffer_mp(imgu_input_fd, outbuf_mp, V4L2_MEMORY_DMABUF, i, &cio2_output_buffers[i], 1));
@@ -223,9 +329,12 @@ auto main(const int argc, const char* const argv[]) -> int {
         ensure_v(v4l2::dequeue_buffer_mp(imgu_output_fd, capbuf_mp, V4L2_MEMORY_DMABUF));
         ensure_v(v4l2::dequeue_buffer_mp(imgu_vf_fd, capbuf_mp, V4L2_MEMORY_DMABUF));
         ensure_v(v4l2::dequeue_buffer(imgu_param_fd, outbuf_meta));
-        ensure_v(v4l2::dequeue_buffer(imgu_stat_fd, capbuf_meta));
+        unwrap_v(stat_index, v4l2::dequeue_buffer(imgu_stat_fd, capbuf_meta));
         ensure_v(v4l2::dequeue_buffer_mp(imgu_input_fd, outbuf_mp, V4L2_MEMORY_DMABUF));
 
+        // feed statistics back into the next frame
+        aaa.process(*static_cast<const ipu3_uapi_stats_3a*>(stat_mmaps[stat_index].start));
+
         // load texutre
         auto       frame      = std::shared_ptr<Frame>(new YUV420SPFrame(vf_width, vf_height, vf_stride));
         const auto byte_array = Frame::ByteArray{static_cast<std::byte*>(vf_mmap_ptrs[i]), imgu_vf_buffers[i].length};
@@ -234,37 +343,97 @@ auto main(const int argc, const char* const argv[]) -> int {
         // process commands while flushing texture
         switch(std::exchange(context.camera_command, Command::None)) {
         case Command::TakePhoto: {
-            const auto path = std::format("{}/{}.jpg", args.savedir, get_save_filename());
-
-            const auto byte_array = Frame::ByteArray{static_cast<std::byte*>(output_mmap_ptrs[i]), imgu_output_buffers[i].length};
-            auto       frame      = YUV420SPFrame(output_width, output_height, output_stride);
-            ensure_v(frame.save_to_jpeg(byte_array, path.data()));
-
-            context.ui_command = Command::TakePhotoDone;
+            burst.start(args.burst);
         } break;
         case Command::StartRecording: {
-            const auto path = std::format("{}/{}.mkv", args.savedir, get_save_filename());
-
-            unwrap_v(pix_fmt, frame->get_pixel_format());
-            auto rc = std::unique_ptr<RecordContext>(new RecordContext());
-            ensure_v(rc->init(path, pix_fmt, output_width, output_height, args));
-            record_context.reset(rc.release());
+            const auto path  = std::format("{}/{}.mkv", args.savedir, get_save_filename());
+            auto       timer = Timer();
+            if(standby.valid()) {
+                // finishing the one being built is quicker than starting over
+                adopt_standby();
+            }
+            const auto warm = record_context != nullptr;
+
+            preroll_pending = false;
+            if(!warm) {
+                ensure_v(create_record_context(*frame, path, false));
+            }
+            if(warm || args.preroll > 0) {
+                // the encoder was set up already, only the file is new
+                ensure_v(record_context->start(path));
+            }
+            std::println("recording started in {}ms{}", timer.elapsed<std::chrono::milliseconds>(), warm ? " (warm)" : "");
 
             context.ui_command = Command::StartRecordingDone;
         } break;
         case Command::StopRecording: {
-            record_context.reset();
-
+            ensure_v(stop_recording());
             context.ui_command = Command::StopRecordingDone;
         } break;
         default:
             break;
         }
+        if(burst.next(context.shutter_held)) {
+            const auto queued = photo_saver.has_room();
+            if(queued) {
+                const auto path = std::format("{}/{}.jpg", args.savedir, get_save_filename());
+                // only copied here, the buffer goes back to the imgu on the next frame
+                const auto byte_array = Frame::ByteArray{static_cast<std::byte*>(output_mmap_ptrs[i]), imgu_output_buffers[i].length};
+                auto       frame      = YUV420SPFrame(output_width, output_height, output_stride);
+                unwrap_v(writer, frame.prepare_jpeg(byte_array));
+                photo_saver.push(writer, path);
+            }
+            burst.record(queued);
+        }
+        if(context.ui_command == Command::None && photo_saver.poll_done()) {
+            // one notice for a whole burst, never over another command
+            context.ui_command = Command::TakePhotoDone;
+        }
+        if(std::exchange(preroll_pending, false)) {
+            // never written unless recording starts, the name only picks the container
+            ensure_v(create_record_context(*frame, std::format("{}/preroll.mkv", args.savedir), false));
+        }
+        // movie mode keeps an idle encoder so that pressing record only opens the file
+        if(standby.valid() && standby.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            adopt_standby();
+        }
+        const auto movie = context.movie && args.preroll == 0;
+        if(!movie) {
+            standby_failed = false;
+        }
+        if(movie && !record_context && !standby.valid() && !standby_failed) {
+            unwrap_v(pix_fmt, frame->get_pixel_format());
+            const auto fps = context.capture_rate > 0 ? context.capture_rate : 30;
+            standby        = std::async(std::launch::async, build_record_context, pix_fmt, std::format("{}/standby.mkv", args.savedir), fps, true);
+        } else if(!movie && record_context && record_context->standby && !record_context->started) {
+            v4l2_encoder.reset();
+            record_context.reset();
+        }
 
-        if(record_context) {
-            unwrap_v(planes, frame->get_planes(byte_array));
-            record_context->encoder.add_frame(planes, record_context->timer.elapsed<std::chrono::microseconds>());
-            record_context->ensure_recording();
+        if(record_context && record_context->wants_frames()) {
+            const auto pts = record_context->timer.elapsed<std::chrono::microseconds>();
+            if(v4l2_encoder) {
+                const auto on_packet = [&](ff::V4L2Encoder::Packet& p) {
+                    record_context->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+                };
+                if(record_context->encoder.take_keyframe_request()) {
+                    v4l2_encoder->force_keyframe(); // lets the next segment start on time
+                }
+                if(v4l2_encoder->can_import()) {
+                    ensure_v(v4l2_encoder->encode_dmabuf(i, imgu_output_buffers[i].fd.as_handle(), pts, on_packet));
+                } else {
+                    const auto y  = static_cast<const std::byte*>(output_mmap_ptrs[i]);
+                    const auto uv = y + output_stride * output_height;
+                    ensure_v(v4l2_encoder->encode(y, output_stride, uv, output_stride, pts, on_packet));
+                }
+            } else {
+                unwrap_v(planes, frame->get_planes(byte_array));
+                record_context->encoder.add_frame(planes, pts);
+            }
+            if(!record_context->ensure_recording()) {
+                ensure_v(stop_recording());
+                context.ui_command = Command::RecordingFailed;
+            }
         }
 
         // update displayed image
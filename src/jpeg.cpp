@@ -2,6 +2,7 @@
 #include <vector>
 
 #include <stdio.h>
+#include <string.h>
 #include <turbojpeg.h>
 
 #include "jpeg.hpp"
@@ -42,25 +43,48 @@ auto BufferDeleter::operator()(std::byte* const buf) -> void {
     tjFree((unsigned char*)buf);
 }
 
-auto calc_jpeg_size(const std::byte* const ptr) -> size_t {
-    auto p = reinterpret_cast<const uint8_t*>(ptr + 2);
-    while(1) {
-        const auto marker = *reinterpret_cast<const uint16_t*>(p);
-        p += 2;
-        const auto seg_size = ((uint8_t)p[0] << 8) + (uint8_t)p[1];
-        p += seg_size;
-        if(marker == 0xdaff) {
-            p += 3;
+auto calc_jpeg_size(const std::span<const std::byte> buf) -> std::optional<size_t> {
+    const auto data = reinterpret_cast<const uint8_t*>(buf.data());
+    const auto size = buf.size();
+    ensure(size >= 4 && data[0] == 0xff && data[1] == 0xd8, "not a jpeg");
+
+    // marker segments up to the start of scan
+    auto p = size_t(2);
+    while(true) {
+        ensure(p + 2 <= size, "truncated jpeg");
+        ensure(data[p] == 0xff, "broken jpeg marker");
+        const auto marker = data[p + 1];
+        if(marker == 0xff) {
+            p += 1; // fill byte
+            continue;
+        }
+        if(marker == 0xd9) {
+            return p + 2;
+        }
+        if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            p += 2; // no length
+            continue;
+        }
+        ensure(p + 4 <= size, "truncated jpeg");
+        const auto seg_size = size_t(data[p + 2]) << 8 | data[p + 3];
+        ensure(seg_size >= 2, "broken jpeg segment");
+        p += 2 + seg_size;
+        if(marker == 0xda) {
             break;
         }
     }
 
-loop_sos:
-    if(p[0] == 0xff && p[1] == 0xd9) {
-        return reinterpret_cast<const std::byte*>(p) - ptr + 2;
+    // the entropy-coded data only has 0xff in front of a stuffed zero or a marker, skip to them with memchr
+    while(p < size) {
+        const auto ff = static_cast<const uint8_t*>(memchr(data + p, 0xff, size - p));
+        ensure(ff != nullptr, "truncated jpeg");
+        p = ff - data + 1;
+        ensure(p < size, "truncated jpeg");
+        if(data[p] == 0xd9) {
+            return p + 1;
+        }
     }
-    p += 1;
-    goto loop_sos;
+    bail("truncated jpeg");
 }
 
 auto decode_jpeg_to_yuvp(const std::byte* const ptr, const size_t len, const size_t downscale_factor) -> std::optional<DecodeResult> {
@@ -97,7 +121,7 @@ auto decode_jpeg_to_yuvp(const std::byte* const ptr, const size_t len, const siz
     };
 }
 
-auto encode_yuvp_to_jpeg(const int width, const int height, const int stride, const int ppc_x, const int ppc_y, const std::byte* const y, const std::byte* const u, const std::byte* const v) -> std::optional<EncodeResult> {
+auto encode_yuvp_to_jpeg(const int width, const int height, const int stride, const int ppc_x, const int ppc_y, const std::byte* const y, const std::byte* const u, const std::byte* const v, const int quality) -> std::optional<EncodeResult> {
     auto tj = AutoTJHandle(tjInitCompress());
     ensure(tj.get() != NULL);
 
@@ -112,21 +136,7 @@ auto encode_yuvp_to_jpeg(const int width, const int height, const int stride, co
                                    strides.data(),
                                    height,
                                    tjsample,
-                                   &buf, &size, 100, 0) == 0);
-    return EncodeResult{Buffer((std::byte*)buf), size};
-}
-
-auto encode_rgba_to_jpeg(const int width, const int height, const int stride, const std::byte* const rgba, const int quality, const bool bottom_up) -> std::optional<EncodeResult> {
-    auto tj = AutoTJHandle(tjInitCompress());
-    ensure(tj.get() != NULL);
-
-    auto buf  = (unsigned char*)(nullptr);
-    auto size = size_t(0);
-    ensure(tjCompress2(tj.get(),
-                       (const unsigned char*)rgba,
-                       width, stride, height,
-                       TJPF_RGBA,
-                       &buf, &size, TJSAMP_420, quality, bottom_up ? TJFLAG_BOTTOMUP : 0) == 0);
+                                   &buf, &size, quality, 0) == 0);
     return EncodeResult{Buffer((std::byte*)buf), size};
 }
 } // namespace jpg
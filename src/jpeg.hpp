@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <optional>
+#include <span>
 #include <vector>
 
 namespace jpg {
@@ -26,8 +27,8 @@ struct EncodeResult {
     size_t size;
 };
 
-auto calc_jpeg_size(const std::byte* ptr) -> size_t;
+// bytes up to the end of image marker, fails instead of reading past buf on a truncated frame
+auto calc_jpeg_size(std::span<const std::byte> buf) -> std::optional<size_t>;
 auto decode_jpeg_to_yuvp(const std::byte* const ptr, size_t len, size_t downscale_factor) -> std::optional<DecodeResult>;
-auto encode_yuvp_to_jpeg(int width, int height, int stride, int ppc_x, int ppc_y, const std::byte* y, const std::byte* u, const std::byte* v) -> std::optional<EncodeResult>;
-auto encode_rgba_to_jpeg(int width, int height, int stride, const std::byte* rgba, int quality = 90, bool bottom_up = false) -> std::optional<EncodeResult>;
+auto encode_yuvp_to_jpeg(int width, int height, int stride, int ppc_x, int ppc_y, const std::byte* y, const std::byte* u, const std::byte* v, int quality = 100) -> std::optional<EncodeResult>;
 } // namespace jpg
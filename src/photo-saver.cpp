@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <print>
+
+#include "photo-saver.hpp"
+#include "macros/assert.hpp"
+
+auto PhotoSaver::worker_main() -> void {
+loop:
+    auto job = Job();
+    {
+        auto guard = std::unique_lock(lock);
+        cond.wait(guard, [this] {
+            return stopping || !jobs.empty();
+        });
+        if(jobs.empty()) {
+            return;
+        }
+        job = std::move(jobs.front());
+        jobs.pop_front();
+    }
+    const auto ok    = job.writer.write(job.path.data());
+    job.writer.write = nullptr; // frees the copied pixels
+    queued.fetch_sub(job.writer.bytes);
+    if(!ok) {
+        WARN("failed to save {}", job.path);
+    }
+    if(pending.fetch_sub(1) == 1) {
+        done.store(true);
+    }
+    goto loop;
+}
+
+auto PhotoSaver::init(size_t num_workers, const size_t budget) -> void {
+    if(num_workers == 0) {
+        // turbojpeg is single threaded, a burst is spread over the cores left to capture
+        num_workers = std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+    }
+    this->budget = budget;
+    for(auto i = 0uz; i < num_workers; i += 1) {
+        workers.emplace_back(&PhotoSaver::worker_main, this);
+    }
+}
+
+auto PhotoSaver::has_room() const -> bool {
+    return budget == 0 || queued.load() < budget;
+}
+
+auto PhotoSaver::push(JpegWriter writer, std::string path) -> void {
+    queued.fetch_add(writer.bytes);
+    pending.fetch_add(1);
+    {
+        const auto guard = std::lock_guard(lock);
+        jobs.push_back({std::move(writer), std::move(path)});
+    }
+    cond.notify_one();
+}
+
+auto PhotoSaver::poll_done() -> bool {
+    return done.exchange(false);
+}
+
+PhotoSaver::~PhotoSaver() {
+    {
+        const auto guard = std::lock_guard(lock);
+        stopping         = true;
+    }
+    cond.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+auto Burst::report() -> void {
+    if(taken + dropped <= 1) {
+        return;
+    }
+    const auto ms = std::max<int64_t>(timer.elapsed<std::chrono::milliseconds>(), 1);
+    std::println("burst: {} photos in {}ms ({:.1f} fps), {} dropped", taken, ms, (taken + dropped) * 1000.0 / ms, dropped);
+}
+
+auto Burst::start(const int count) -> void {
+    timer.reset();
+    remaining = count > 0 ? count : -1;
+    taken     = 0;
+    dropped   = 0;
+}
+
+auto Burst::next(const bool held) -> bool {
+    // a short tap still takes one
+    if(remaining < 0 && !held && taken + dropped > 0) {
+        remaining = 0;
+        report();
+    }
+    return remaining != 0;
+}
+
+auto Burst::record(const bool queued) -> void {
+    (queued ? taken : dropped) += 1;
+    if(remaining > 0 && (remaining -= 1) == 0) {
+        report();
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graphics-wrapper.hpp"
+#include "timer.hpp"
+
+// encodes and writes photos on worker threads, so that the capture loop only pays for a copy
+class PhotoSaver {
+  private:
+    struct Job {
+        JpegWriter  writer;
+        std::string path;
+    };
+
+    std::mutex               lock;
+    std::condition_variable  cond;
+    std::deque<Job>          jobs;
+    std::vector<std::thread> workers;
+    size_t                   budget   = 0;
+    std::atomic<size_t>      queued   = 0; // bytes of pixels held by unfinished jobs
+    std::atomic<size_t>      pending  = 0; // unfinished jobs
+    std::atomic<bool>        done     = false; // pending dropped to zero since the last poll_done()
+    bool                     stopping = false;
+
+    auto worker_main() -> void;
+
+  public:
+    // 0 workers = picked from the core count, 0 budget = unbounded
+    auto init(size_t num_workers, size_t budget) -> void;
+    // check before copying a frame, the budget is exceeded by one frame at most
+    auto has_room() const -> bool;
+    auto push(JpegWriter writer, std::string path) -> void;
+    // true once every photo pushed so far is written, for the capture loop to tell the ui
+    auto poll_done() -> bool;
+
+    // writes the queued photos before returning
+    ~PhotoSaver();
+};
+
+// photos from consecutive frames for one press of the shutter
+class Burst {
+  private:
+    Timer timer;
+    int   remaining = 0; // negative while the shutter is held
+    int   taken     = 0;
+    int   dropped   = 0;
+
+    auto report() -> void;
+
+  public:
+    // count 0 lasts while held
+    auto start(int count) -> void;
+    // whether the current frame belongs to the burst
+    auto next(bool held) -> bool;
+    // after next() returned true
+    auto record(bool queued) -> void;
+};
@@ -0,0 +1,57 @@
+#include <print>
+#include <thread>
+#include <vector>
+
+#include "macros/assert.hpp"
+#include "macros/unwrap.hpp"
+#include "raw-writer.hpp"
+#include "util/charconv.hpp"
+#include "v4l2.hpp"
+
+// feeds synthetic yuyv frames at a fixed rate, shows whether a disk keeps up with --video-codec raw
+// usage: raw-writer-bench PATH [WIDTH HEIGHT FPS SECONDS]
+auto main(const int argc, const char* const* const argv) -> int {
+    ensure(argc == 2 || argc == 6, "usage: {} PATH [WIDTH HEIGHT FPS SECONDS]", argv[0]);
+    auto width   = 1920;
+    auto height  = 1080;
+    auto fps     = 120;
+    auto seconds = 10;
+    if(argc == 6) {
+        unwrap(w, from_chars<int>(argv[2]));
+        unwrap(h, from_chars<int>(argv[3]));
+        unwrap(f, from_chars<int>(argv[4]));
+        unwrap(s, from_chars<int>(argv[5]));
+        width   = w;
+        height  = h;
+        fps     = f;
+        seconds = s;
+    }
+
+    const auto stride = width * 2;
+    const auto size   = size_t(stride) * height;
+    auto       writer = RawWriter();
+    ensure(writer.init({v4l2::fourcc("YUYV"), uint32_t(width), uint32_t(height), uint32_t(stride), size}, 256 * 1024 * 1024));
+    ensure(writer.open(argv[1]));
+
+    // a few distinct frames, so that nothing below can shortcut repeated data
+    auto frames = std::vector<std::vector<std::byte>>(4);
+    for(auto i = 0uz; i < frames.size(); i += 1) {
+        frames[i].resize(size);
+        for(auto j = 0uz; j < size; j += 1) {
+            frames[i][j] = std::byte((j * 7 + i * 31) & 0xff);
+        }
+    }
+
+    std::println("writing {}x{} yuyv at {}fps for {}s, {:.0f} MiB/s needed", width, height, fps, seconds, 1.0 * size * fps / 1048576);
+    const auto interval = std::chrono::microseconds(1000000 / fps);
+    auto       next     = std::chrono::steady_clock::now();
+    auto       dropped  = 0;
+    for(auto i = 0; i < fps * seconds; i += 1) {
+        dropped += writer.add_frame(frames[i % frames.size()], int64_t(i) * interval.count()) ? 0 : 1;
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+    std::println("{} of {} frames dropped", dropped, fps * seconds);
+    ensure(writer.close());
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <print>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "macros/assert.hpp"
+#include "raw-writer.hpp"
+
+namespace {
+auto align_up(const size_t size) -> size_t {
+    return (size + raw_align - 1) / raw_align * raw_align;
+}
+} // namespace
+
+auto RawWriter::AlignedFree::operator()(std::byte* const ptr) -> void {
+    free(ptr);
+}
+
+auto RawWriter::write_all(const std::byte* data, size_t size, uint64_t offset) -> bool {
+    while(size > 0) {
+        const auto ret = pwrite(fd, data, size, offset);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret < 0 && errno == EINVAL && direct) {
+            // some filesystems accept O_DIRECT at open() and refuse it here
+            WARN("direct io refused, falling back to buffered writes");
+            ensure(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == 0);
+            direct = false;
+            continue;
+        }
+        ensure(ret > 0, "write failed: {}", errno);
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+auto RawWriter::writer_main() -> void {
+loop:
+    auto chunk = (Chunk*)(nullptr);
+    {
+        auto guard = std::unique_lock(lock);
+        cond.wait(guard, [this] {
+            return stopping || !full_chunks.empty();
+        });
+        if(full_chunks.empty()) {
+            return;
+        }
+        chunk = full_chunks.front();
+        full_chunks.pop_front();
+    }
+
+    auto       elapsed = Timer();
+    const auto ok      = write_all(chunk->data.get(), chunk->used, chunk->offset);
+    const auto us      = elapsed.elapsed<std::chrono::microseconds>();
+    {
+        const auto guard = std::lock_guard(lock);
+        failed |= !ok;
+        written += ok ? chunk->used : 0;
+        write_us += us;
+        free_chunks.push_back(chunk);
+    }
+    cond.notify_all();
+    goto loop;
+}
+
+auto RawWriter::take_chunk() -> bool {
+    if(free_chunks.empty()) {
+        return false;
+    }
+    current         = free_chunks.front();
+    current->offset = file_end;
+    current->used   = 0;
+    free_chunks.pop_front();
+    return true;
+}
+
+auto RawWriter::submit_chunk() -> void {
+    // the tail is padded so that every write stays aligned
+    current->used = align_up(current->used);
+    file_end += current->used;
+    full_chunks.push_back(current);
+    current = nullptr;
+    cond.notify_all();
+}
+
+auto RawWriter::init(const RawFormat format, const size_t buffer_bytes) -> bool {
+    header.fourcc = format.fourcc;
+    header.width  = format.width;
+    header.height = format.height;
+    header.stride = format.stride;
+
+    // large enough for a few frames, small enough to keep the writer busy
+    chunk_size       = std::max(size_t(16) << 20, align_up(format.max_frame_size) * 4);
+    const auto count = std::max(size_t(2), buffer_bytes / chunk_size);
+    for(auto i = 0uz; i < count; i += 1) {
+        auto ptr = (void*)(nullptr);
+        ensure(posix_memalign(&ptr, raw_align, chunk_size) == 0);
+        memset(ptr, 0, chunk_size);
+        chunks.push_back({std::unique_ptr<std::byte, AlignedFree>(static_cast<std::byte*>(ptr)), 0, 0});
+    }
+    for(auto& chunk : chunks) {
+        free_chunks.push_back(&chunk);
+    }
+    index.reserve(4096);
+    return true;
+}
+
+auto RawWriter::open(const std::string& path) -> bool {
+    fd     = ::open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    direct = fd >= 0;
+    if(!direct) {
+        // tmpfs and friends
+        fd = ::open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    ensure(fd >= 0, "failed to open {}: {}", path, errno);
+
+    ensure(take_chunk());
+    memcpy(current->data.get(), &header, sizeof(header));
+    current->used = raw_align;
+
+    timer.reset();
+    writer = std::thread(&RawWriter::writer_main, this);
+    return true;
+}
+
+auto RawWriter::add_frame(const std::span<const std::byte> data, const int64_t pts_us) -> bool {
+    const auto guard = std::lock_guard(lock);
+    if(stopping || fd < 0 || failed) {
+        return false;
+    }
+    ensure(align_up(data.size()) <= chunk_size, "frame of {} bytes does not fit in a chunk", data.size());
+    if(current != nullptr && current->used + data.size() > chunk_size) {
+        submit_chunk();
+    }
+    if(current == nullptr && !take_chunk()) {
+        // the disk is behind, better a gap than a stalled capture
+        dropped += 1;
+        return false;
+    }
+    memcpy(current->data.get() + current->used, data.data(), data.size());
+    index.push_back({pts_us, current->offset + current->used, data.size()});
+    current->used = align_up(current->used + data.size());
+    return true;
+}
+
+auto RawWriter::close() -> bool {
+    if(fd < 0) {
+        return true;
+    }
+    {
+        const auto guard = std::lock_guard(lock);
+        if(current != nullptr) {
+            submit_chunk();
+        }
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+
+    // the index is not aligned, write it through the page cache
+    if(direct) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+    const auto trailer      = RawTrailer{.index_offset = file_end, .frame_count = index.size()};
+    const auto index_bytes  = index.size() * sizeof(RawIndexEntry);
+    const auto index_ok     = write_all(reinterpret_cast<const std::byte*>(index.data()), index_bytes, file_end);
+    const auto trailer_ok   = index_ok && write_all(reinterpret_cast<const std::byte*>(&trailer), sizeof(trailer), file_end + index_bytes);
+    const auto secs         = timer.elapsed<std::chrono::milliseconds>() / 1000.0;
+    const auto mib          = written / 1048576.0;
+    const auto disk_mib_sec = write_us > 0 ? mib * 1000000 / write_us : 0.0;
+    ::close(fd);
+    fd = -1;
+
+    std::println("raw: {} frames, {:.0f} MiB in {:.1f}s, disk {:.0f} MiB/s{}, {} dropped",
+                 index.size(), mib, secs, disk_mib_sec, direct ? " (direct)" : "", dropped);
+    ensure(!failed && trailer_ok, "raw recording is incomplete");
+    return true;
+}
+
+RawWriter::~RawWriter() {
+    close();
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "timer.hpp"
+
+// file layout, native endian
+// RawHeader at 0, then the frames, each starting at a multiple of raw_align
+// then a RawIndexEntry per frame in write order, and a RawTrailer at the very end
+constexpr auto raw_align = size_t(4096);
+
+struct RawHeader {
+    char     magic[8] = {'W', 'L', 'C', 'A', 'M', 'R', 'A', 'W'};
+    uint32_t version  = 1;
+    uint32_t fourcc; // v4l2 pixel format
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; // bytes per line, 0 for compressed formats
+    uint32_t reserved = 0;
+};
+
+struct RawIndexEntry {
+    int64_t  pts_us;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct RawTrailer {
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char     magic[8] = {'W', 'L', 'C', 'A', 'M', 'I', 'D', 'X'};
+};
+
+struct RawFormat {
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    size_t   max_frame_size;
+};
+
+// copies captured buffers into large aligned chunks, a thread writes them out with O_DIRECT when the filesystem allows
+// frames are dropped instead of blocking the caller when the disk falls behind
+class RawWriter {
+  private:
+    struct AlignedFree {
+        auto operator()(std::byte* ptr) -> void;
+    };
+
+    struct Chunk {
+        std::unique_ptr<std::byte, AlignedFree> data;
+        uint64_t                                offset; // in the file
+        size_t                                  used;
+    };
+
+    RawHeader          header;
+    size_t             chunk_size;
+    std::vector<Chunk> chunks;
+    int                fd     = -1;
+    bool               direct = false;
+    std::thread        writer;
+
+    std::mutex                 lock;
+    std::condition_variable    cond;
+    std::deque<Chunk*>         free_chunks;
+    std::deque<Chunk*>         full_chunks;
+    Chunk*                     current  = nullptr; // being filled by add_frame()
+    uint64_t                   file_end = 0;       // offset of the next chunk
+    std::vector<RawIndexEntry> index;
+    bool                       stopping = false;
+    bool                       failed   = false;
+
+    // stats
+    Timer    timer;
+    uint64_t written  = 0;
+    uint64_t write_us = 0; // time spent in pwrite()
+    size_t   dropped  = 0;
+
+    auto writer_main() -> void;
+    auto write_all(const std::byte* data, size_t size, uint64_t offset) -> bool;
+    auto take_chunk() -> bool;
+    auto submit_chunk() -> void;
+
+  public:
+    // allocates and touches the chunks up front, so that a standby writer costs nothing at the first frame
+    auto init(RawFormat format, size_t buffer_bytes) -> bool;
+    auto open(const std::string& path) -> bool;
+    // can be called from any thread, false when the frame was dropped
+    auto add_frame(std::span<const std::byte> data, int64_t pts_us) -> bool;
+    // flushes the chunks and appends the index
+    auto close() -> bool;
+
+    ~RawWriter();
+};
@@ -1,6 +1,96 @@
+#include <thread>
+
 #include "record-context.hpp"
 #include "macros/assert.hpp"
 
+namespace {
+auto to_av_codec_id(const ff::V4L2Codec codec) -> AVCodecID {
+    switch(codec) {
+    case ff::V4L2Codec::H264:
+        return AV_CODEC_ID_H264;
+    case ff::V4L2Codec::HEVC:
+        return AV_CODEC_ID_HEVC;
+    case ff::V4L2Codec::VP8:
+        return AV_CODEC_ID_VP8;
+    case ff::V4L2Codec::VP9:
+        return AV_CODEC_ID_VP9;
+    default:
+        return AV_CODEC_ID_NONE;
+    }
+}
+
+// fills what the user left to us from the core count and the pixel rate
+auto build_internal_params(const CommonArgs& args, const AVPixelFormat pix_fmt, const int width, const int height, const int fps) -> ff::VideoParamsInternal {
+    const auto cores    = std::max(1, int(std::thread::hardware_concurrency()));
+    const auto mpps     = 1.0 * width * height * fps / 1000000; // megapixels per second
+    const auto per_core = mpps / cores;
+    const auto codec    = std::string_view(args.video_codec);
+    const auto is_x26x  = codec.starts_with("libx26");
+    const auto lossless = codec == "ffv1" || codec == "utvideo";
+
+    auto ret = ff::VideoParamsInternal{
+        .codec = {
+            .name    = std::string(args.video_codec),
+            .options = {},
+        },
+        .pix_fmt = pix_fmt,
+        .width   = width,
+        .height  = height,
+        // keep a core for capture and preview
+        .threads = args.video_threads > 0 ? args.video_threads : std::max(1, cores - 1),
+        // frame threads scale better but each one holds a frame, small machines get slices
+        .thread_type = args.codec_thread_type != 0 ? args.codec_thread_type : cores > 4 ? FF_THREAD_FRAME : FF_THREAD_SLICE,
+        .filter      = std::string(args.video_filter),
+    };
+    // b-frames cost a reference frame of motion search each, drop them when short of cpu
+    ret.b_frames = args.video_b_frames >= 0 ? args.video_b_frames : per_core > 8 || cores <= 2 || lossless ? 0 : 3;
+    if(lossless) {
+        // intra only, slices are the only threading that keeps up at high frame rates
+        if(args.codec_thread_type == 0) {
+            ret.thread_type = FF_THREAD_SLICE;
+        }
+        // neither takes packed yuv or nv12, convert to the planar layout of the same subsampling
+        if(ret.filter.empty() && (pix_fmt == AV_PIX_FMT_YUYV422 || pix_fmt == AV_PIX_FMT_NV12)) {
+            ret.filter = pix_fmt == AV_PIX_FMT_YUYV422 ? "format=yuv422p" : "format=yuv420p";
+        }
+    }
+
+    auto& options = ret.codec.options;
+    if(args.video_preset[0] != '\0') {
+        options.push_back({"preset", args.video_preset});
+    } else if(is_x26x) {
+        options.push_back({"preset", per_core < 4 ? "veryfast" : per_core < 10 ? "superfast" : "ultrafast"});
+    }
+    if(args.video_tune[0] != '\0') {
+        options.push_back({"tune", args.video_tune});
+    }
+    if(args.video_crf >= 0) {
+        options.push_back({"crf", std::to_string(args.video_crf)});
+    }
+    // the default 40 frames of lookahead is most of the encoding latency and memory
+    const auto lookahead = args.video_lookahead >= 0 ? args.video_lookahead : is_x26x && cores <= 4 ? std::min(fps, 10) : -1;
+    if(lookahead >= 0 && codec.starts_with("libx264")) {
+        options.push_back({"rc-lookahead", std::to_string(lookahead)});
+    } else if(lookahead >= 0 && codec == "libx265") {
+        // not an avoption there, only reachable through the x265 parameter string
+        options.push_back({"x265-params", "rc-lookahead=" + std::to_string(lookahead)});
+    } else if(lookahead >= 0) {
+        WARN("--video-lookahead is ignored by {}", codec);
+    }
+    if(codec == "ffv1") {
+        options.push_back({"level", "3"});
+        options.push_back({"g", "1"});
+        options.push_back({"slices", cores < 4 ? "4" : cores < 12 ? "12" : "24"});
+    }
+    options.insert(options.end(), args.codec_options.begin(), args.codec_options.end());
+
+    if(args.ffmpeg_debug) {
+        std::println("encoder tuning: {} cores, {:.1f} Mpixel/s, {} threads, {} b-frames", cores, mpps, ret.threads, ret.b_frames);
+    }
+    return ret;
+}
+} // namespace
+
 auto RecordContext::init(std::string path, ff::VideoParams vopts, const CommonArgs& args) -> bool {
     auto aopts = ff::AudioParams::create<ff::AudioParamsInternal>(ff::AudioParamsInternal{
         .codec = {
@@ -16,6 +106,17 @@ auto RecordContext::init(std::string path, ff::VideoParams vopts, const CommonAr
         .output       = std::move(path),
         .video        = std::move(vopts),
         .audio        = std::move(aopts),
+        .segment      = {
+            .seconds   = args.segment_seconds,
+            .bytes     = int64_t(args.segment_mbytes) * 1024 * 1024,
+            .keep_secs = args.segment_keep * 60,
+        },
+        .preroll      = {
+            .seconds = args.preroll,
+            .bytes   = int64_t(args.preroll_mbytes) * 1024 * 1024,
+        },
+        .defer_output = standby,
+        .fragmented   = args.fragmented,
         .ffmpeg_debug = args.ffmpeg_debug,
     };
     ensure(encoder.init(std::move(encoder_params)));
@@ -35,25 +136,18 @@ auto RecordContext::init(std::string path, ff::VideoParams vopts, const CommonAr
     return true;
 }
 
-auto RecordContext::init(std::string path, const AVPixelFormat pix_fmt, const int width, const int height, const CommonArgs& args) -> bool {
+auto RecordContext::init(std::string path, const AVPixelFormat pix_fmt, const int width, const int height, const int fps, const CommonArgs& args) -> bool {
     return init(std::move(path),
-                ff::VideoParams::create<ff::VideoParamsInternal>(ff::VideoParamsInternal{
-                    .codec = {
-                        .name    = std::string(args.video_codec),
-                        .options = {},
-                    },
-                    .pix_fmt = pix_fmt,
-                    .width   = width,
-                    .height  = height,
-                    .threads = 4,
-                    .filter  = std::string(args.video_filter),
-                }),
+                ff::VideoParams::create<ff::VideoParamsInternal>(build_internal_params(args, pix_fmt, width, height, fps)),
                 args);
 }
 
 auto RecordContext::init(std::string path, int real_width, int real_height, int coded_width, int coded_height, const CommonArgs& args) -> bool {
+    const auto codec_id = to_av_codec_id(args.encoder_config.codec);
+    ensure(codec_id != AV_CODEC_ID_NONE, "{} cannot be muxed", ff::v4l2_codec_name(args.encoder_config.codec));
     return init(std::move(path),
                 ff::VideoParams::create<ff::VideoParamsExternal>(ff::VideoParamsExternal{
+                    .codec_id     = codec_id,
                     .real_width   = real_width,
                     .real_height  = real_height,
                     .coded_width  = coded_width,
@@ -62,11 +156,55 @@ auto RecordContext::init(std::string path, int real_width, int real_height, int
                 args);
 }
 
-auto RecordContext::ensure_recording() -> void {
+auto RecordContext::init_copy(std::string path, const int width, const int height, const CommonArgs& args) -> bool {
+    return init(std::move(path),
+                ff::VideoParams::create<ff::VideoParamsExternal>(ff::VideoParamsExternal{
+                    .codec_id     = AV_CODEC_ID_MJPEG,
+                    .real_width   = width,
+                    .real_height  = height,
+                    .coded_width  = width,
+                    .coded_height = height,
+                    .mjpeg_dht    = args.mjpeg_dht,
+                }),
+                args);
+}
+
+auto RecordContext::init_raw(std::string path, const RawFormat format, const CommonArgs& args) -> bool {
+    raw = std::make_unique<RawWriter>();
+    ensure(raw->init(format, size_t(args.raw_buffer_mbytes) * 1024 * 1024));
+    if(!standby) {
+        ensure(raw->open(path));
+    }
+    return true;
+}
+
+auto RecordContext::start(std::string path) -> bool {
+    if(standby) {
+        // nothing was encoded yet, line the video up with the audio which starts from zero
+        timer.reset();
+    }
+    if(raw) {
+        ensure(raw->open(path));
+    } else {
+        ensure(encoder.start_output(std::move(path)));
+    }
+    started = true;
+    return true;
+}
+
+auto RecordContext::wants_frames() const -> bool {
+    return !standby || started;
+}
+
+auto RecordContext::ensure_recording() -> bool {
+    if(encoder.has_failed()) {
+        return false;
+    }
     if(!audio_started.load() && encoder.is_header_written()) {
         audio_started.store(true);
         recorder_thread = std::thread(&RecordContext::recorder_main, this);
     }
+    return true;
 }
 auto RecordContext::recorder_main() -> bool {
     const auto num_samples_per_push = encoder.get_audio_samples_per_push();
@@ -78,7 +216,8 @@ loop:
     ensure(samples);
     const auto frame = converter.convert(samples->data(), num_samples_per_push);
     ensure(frame);
-    encoder.add_audio(frame->get());
+    // the camera stops the recording once the encoder fails
+    ensure(encoder.add_audio(frame->get()) || !encoder.has_failed());
     goto loop;
 }
 
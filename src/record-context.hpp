@@ -6,6 +6,7 @@
 
 #include "args.hpp"
 #include "pulse-recorder/pulse.hpp"
+#include "raw-writer.hpp"
 #include "timer.hpp"
 #include "video-encoder/converter.hpp"
 #include "video-encoder/encoder.hpp"
@@ -18,17 +19,28 @@ struct RecordContext {
     std::thread        recorder_thread;
     std::atomic<bool>  audio_started = false;
     bool               running;
+    bool               standby = false; // set before init(), frames are ignored until start()
+    std::atomic<bool>  started = false;
+
+    std::unique_ptr<RawWriter> raw; // --video-codec raw, the encoder and the recorder are not used
 
     // private
     auto recorder_main() -> bool;
     auto init(std::string path, ff::VideoParams vopts, const CommonArgs& args) -> bool;
 
     // internal video encoder
-    auto init(std::string path, AVPixelFormat pix_fmt, int width, int height, const CommonArgs& args) -> bool;
-    // external video encoder
+    auto init(std::string path, AVPixelFormat pix_fmt, int width, int height, int fps, const CommonArgs& args) -> bool;
+    // external video encoder, the codec is taken from args.encoder_config
     auto init(std::string path, int real_width, int real_height, int coded_width, int coded_height, const CommonArgs& args) -> bool;
-    // start recording if ready
-    auto ensure_recording() -> void;
+    // --video-codec copy, the camera's jpeg frames are muxed as they are
+    auto init_copy(std::string path, int width, int height, const CommonArgs& args) -> bool;
+    // --video-codec raw, the camera's buffers are written as they are
+    auto init_raw(std::string path, RawFormat format, const CommonArgs& args) -> bool;
+    // with --preroll or standby the context is created while idle and only the file is opened here
+    auto start(std::string path) -> bool;
+    auto wants_frames() const -> bool;
+    // start recording if ready, false once the output cannot be written
+    auto ensure_recording() -> bool;
 
     ~RecordContext();
 };
@@ -0,0 +1,39 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <optional>
+
+// bounded lock-free queue between exactly one producer thread and one consumer thread
+template <class T, size_t capacity>
+class SPSCQueue {
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+  private:
+    std::array<T, capacity> slots;
+
+    alignas(64) std::atomic<size_t> head = 0; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail = 0; // next slot to push, written by the producer
+
+  public:
+    // producer side, fails and leaves value untouched when full
+    auto push(T&& value) -> bool {
+        const auto t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == capacity) {
+            return false;
+        }
+        slots[t % capacity] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    auto pop() -> std::optional<T> {
+        const auto h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        auto value = std::move(slots[h % capacity]);
+        head.store(h + 1, std::memory_order_release);
+        return value;
+    }
+};
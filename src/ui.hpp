@@ -41,6 +41,10 @@ struct Button {
         return true;
     }
 
+    // press and release, before on_pressed()
+    virtual auto on_held(bool /*held*/) -> void {
+    }
+
     // runtime states
     gawl::Point       displayed_pos = {0, 0};
     gawl::WrappedText wrapped_text;
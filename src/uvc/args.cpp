@@ -29,10 +29,12 @@ auto Args::parse(const int argc, const char* const* const argv) -> std::optional
     parser.kwarg(&args.video_device, {"-d", "--device"}, "PATH", "video device", {.state = args::State::DefaultValue});
     parser.kwarg(&args.fps, {"--fps"}, "FPS", "refresh rate", {.state = args::State::DefaultValue});
     parser.kwarg(&args.pixel_format, {"--pix-format"}, "{MJPG|YUYV|NV12}", "pixel format", {.state = args::State::DefaultValue});
+    parser.kwflag(&args.mjpeg_dht, {"--mjpeg-dht"}, "insert huffman tables into copied mjpeg frames, for players that need them");
     parser.kwflag(&args.list_formats, {"-l", "--list-formats"}, "list supported formats of the video device", {.no_error_check = true});
     if(!parser.parse(argc, argv) || args.help) {
         std::println("usage: wlcam-uvc {}", parser.get_help());
         exit(0);
     }
+    ensure(resolve_common_args(args));
     return args;
 }
@@ -1,9 +1,11 @@
 #include <coop/io.hpp>
 #include <coop/parallel.hpp>
 #include <poll.h>
+#include <print>
 #include <unistd.h>
 
 #include "../macros/coop-unwrap.hpp"
+#include "../macros/unwrap.hpp"
 #include "camera.hpp"
 
 auto Camera::loader_main(const size_t index) -> coop::Async<void> {
@@ -36,12 +38,59 @@ loop:
     }
     const auto byte_array = Frame::ByteArray{static_cast<std::byte*>(params.buffers[index].start), params.buffers[index].length};
 
-    const auto ret = co_await loader.thread.run([&]() {
+    // only the newest frame is encoded or shot, as it is the one shown
+    // decided before the requeue, so that the pixels are copied while the buffer is still ours
+    const auto newest = front_frame_count < frame_count;
+    if(newest && params.window_context->camera_command == Command::TakePhoto) {
+        params.window_context->camera_command = Command::None;
+        burst.start(params.args->burst);
+    }
+    const auto shoot  = newest && burst.next(params.window_context->shutter_held);
+    const auto queued = shoot && photo_saver.has_room();
+    auto       photo  = std::optional<JpegWriter>();
+    auto       failed = std::shared_ptr<RecordContext>(); // whose encoder failed on this frame
+    const auto ret    = co_await loader.thread.run([&, rc = record_context, enc = v4l2_encoder]() mutable {
+        if(rc && rc->raw && rc->wants_frames()) {
+            // every frame is kept, and before the buffer goes back to the driver
+            write_raw(*rc, fmt, byte_array);
+        }
+        if(queued) {
+            // mjpeg is written as received, other formats are encoded by the saver
+            photo = frame->prepare_jpeg(byte_array);
+        }
         const auto ret = frame->load_texture(byte_array);
+        if(ret && rc && !rc->raw && rc->wants_frames()) {
+            if(params.args->copy_video) {
+                // no decode or encode, muxed as received, the packet is a copy made before the requeue
+                if(const auto size = jpg::calc_jpeg_size(byte_array)) {
+                    rc->encoder.add_video_packet(byte_array.data(), *size, rc->timer.elapsed<std::chrono::microseconds>(), true);
+                }
+            } else if(newest && !encode_frame(*rc, enc.get(), *frame, byte_array)) {
+                failed = rc;
+            }
+        }
+        // may be the last references if recording stopped meanwhile, their teardown blocks
+        rc.reset();
+        enc.reset();
         loader.context.flush();
         return ret;
     });
     coop_ensure(v4l2::queue_buffer(params.fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+    if(failed) {
+        if(record_context == failed) {
+            co_await stop_recording(loader);
+            params.window_context->ui_command = Command::RecordingFailed;
+        }
+        co_await loader.thread.run([&]() {
+            failed.reset();
+        });
+    }
+    if(shoot) {
+        if(photo) {
+            photo_saver.push(std::move(*photo), std::format("{}/{}.jpg", params.args->savedir, get_save_filename()));
+        }
+        burst.record(photo.has_value());
+    }
     if(!ret) {
         WARN("failed to decode image");
         goto loop;
@@ -58,43 +107,185 @@ loop:
     // proc command
     switch(std::exchange(params.window_context->camera_command, Command::None)) {
     case Command::TakePhoto: {
-        const auto path = std::format("{}/{}.jpg", params.args->savedir, get_save_filename());
-
-        coop_ensure(co_await loader.thread.run([&]() {
-            return frame->save_to_jpeg(byte_array, path.data());
-        }));
-
-        params.window_context->ui_command = Command::TakePhotoDone;
+        // arrived while this frame was loading, the burst starts from the next one
+        burst.start(params.args->burst);
     } break;
     case Command::StartRecording: {
-        const auto path = std::format("{}/{}.mkv", params.args->savedir, get_save_filename());
+        const auto path  = std::format("{}/{}.{}", params.args->savedir, get_save_filename(), params.args->raw_video ? "raw" : "mkv");
+        auto       timer = Timer();
+        const auto warm  = record_context != nullptr;
 
-        co_unwrap_v(pix_fmt, frame->get_pixel_format());
-        record_context.reset(new RecordContext());
-        co_ensure_v(record_context->init(path, pix_fmt, params.width, params.height, *params.args));
+        preroll_pending = false;
+        if(!warm) {
+            coop_ensure(co_await create_record_context(loader, *frame, path, false));
+        }
+        if(warm || params.args->preroll > 0) {
+            // the encoder was set up already, only the file is new
+            const auto rc = record_context;
+            coop_ensure(co_await loader.thread.run([&]() {
+                return rc->start(path);
+            }));
+        }
+        std::println("recording started in {}ms{}", timer.elapsed<std::chrono::milliseconds>(), warm ? " (warm)" : "");
 
         params.window_context->ui_command = Command::StartRecordingDone;
     } break;
     case Command::StopRecording: {
-        record_context.reset();
-
+        co_await stop_recording(loader);
         params.window_context->ui_command = Command::StopRecordingDone;
     } break;
     default:
         break;
     }
-
-    if(const auto rc = record_context) {
-        co_unwrap_v(planes, frame->get_planes(byte_array));
+    if(params.window_context->ui_command == Command::None && photo_saver.poll_done()) {
+        // one notice for a whole burst, never over another command
+        params.window_context->ui_command = Command::TakePhotoDone;
+    }
+    if(std::exchange(preroll_pending, false)) {
+        // never written unless recording starts, the name only picks the container
+        coop_ensure(co_await create_record_context(loader, *frame, std::format("{}/preroll.mkv", params.args->savedir), false));
+    }
+    // movie mode keeps an idle encoder so that pressing record only opens the file
+    const auto movie = params.window_context->movie && params.args->preroll == 0;
+    if(!movie) {
+        standby_failed = false;
+    }
+    if(movie && !record_context && !warming && !standby_failed) {
+        warming = true;
+        if(!co_await create_record_context(loader, *frame, std::format("{}/standby.mkv", params.args->savedir), true)) {
+            WARN("failed to create the standby encoder, recording will start cold");
+            standby_failed = true;
+        }
+        warming = false;
+    } else if(!movie && record_context && record_context->standby && !record_context->started) {
+        // the loaders hold their own references while encoding, ours is dropped off the ui thread too
+        auto rc  = std::exchange(record_context, nullptr);
+        auto enc = std::exchange(v4l2_encoder, nullptr);
         co_await loader.thread.run([&]() {
-            rc->encoder.add_frame(planes, rc->timer.elapsed<std::chrono::microseconds>());
-            rc->ensure_recording();
+            enc.reset();
+            rc.reset();
         });
     }
 
     goto loop;
 }
 
+auto Camera::encode_frame(RecordContext& rc, ff::V4L2Encoder* const enc, const Frame& frame, const Frame::ByteArray byte_array) -> bool {
+    unwrap(planes, frame.get_planes(byte_array));
+    const auto pts = rc.timer.elapsed<std::chrono::microseconds>();
+    if(enc != nullptr) {
+        // a no-op once StopRecording has drained it under the same lock
+        const auto lock = std::lock_guard(v4l2_encoder_lock);
+        if(rc.encoder.take_keyframe_request()) {
+            enc->force_keyframe(); // lets the next segment start on time
+        }
+        ensure(enc->encode(planes[0].data, planes[0].stride, planes[1].data, planes[1].stride, pts, [&rc](ff::V4L2Encoder::Packet& p) {
+            rc.encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+        }));
+    } else {
+        rc.encoder.add_frame(planes, pts);
+    }
+    return rc.ensure_recording();
+}
+
+auto Camera::stop_recording(Loader& loader) -> coop::Async<void> {
+    // detach first, the other loaders must not see a half-stopped recording
+    auto rc = std::exchange(record_context, nullptr);
+    if(rc && rc->raw) {
+        // flushing the last chunks takes a while, keep it off the ui thread
+        co_await loader.thread.run([&]() {
+            rc->raw->close();
+        });
+    }
+    if(auto enc = std::exchange(v4l2_encoder, nullptr)) {
+        co_await loader.thread.run([&]() {
+            const auto lock = std::lock_guard(v4l2_encoder_lock);
+            enc->drain([&rc](ff::V4L2Encoder::Packet& p) {
+                rc->encoder.add_video_packet(p.data, p.size, p.pts_us, p.keyframe, std::exchange(p.release, nullptr), p.opaque);
+            });
+            enc.reset();
+        });
+    }
+    if(rc) {
+        // the last reference writes the trailer and joins the encoder threads, as in camss
+        co_await loader.thread.run([&]() {
+            rc.reset();
+        });
+    }
+    preroll_pending = params.args->preroll > 0;
+}
+
+auto Camera::write_raw(RecordContext& rc, const v4l2_pix_format& fmt, const Frame::ByteArray byte_array) -> void {
+    auto data = byte_array.first(std::min<size_t>(byte_array.size(), fmt.sizeimage));
+    if(fmt.pixelformat == v4l2::fourcc("MJPG")) {
+        // the buffer is sized for the worst case, only keep the frame
+        const auto size = jpg::calc_jpeg_size(byte_array);
+        if(!size) {
+            return;
+        }
+        data = byte_array.first(*size);
+    }
+    rc.raw->add_frame(data, rc.timer.elapsed<std::chrono::microseconds>());
+}
+
+auto Camera::create_record_context(Loader& loader, const Frame& frame, const std::string path, const bool standby) -> coop::Async<bool> {
+    constexpr static auto error_value = false;
+
+    auto rc     = std::make_shared<RecordContext>();
+    rc->standby = standby;
+    if(params.args->use_v4l2_encoder) {
+        // nv12 frames are copied into the encoder's buffers, no gl involved
+        const auto& config = params.args->encoder_config;
+        auto        enc    = std::make_shared<ff::V4L2Encoder>();
+        co_ensure_v(co_await loader.thread.run([&]() {
+            unwrap(node, v4l2_encoder_node.get()); // only waits when recording right after startup
+            ensure(enc->init_cpu(node.data(), params.width, params.height, params.fps, config));
+            ensure(rc->init(path, params.width, params.height, enc->coded_width(), enc->coded_height(), *params.args));
+            return true;
+        }));
+        if(standby && record_context) {
+            // recording was started meanwhile
+            co_return true;
+        }
+        v4l2_encoder   = std::move(enc);
+        record_context = std::move(rc);
+    } else if(params.args->raw_video) {
+        co_unwrap_v(fmt, v4l2::get_current_format(params.fd));
+        const auto format = RawFormat{
+            .fourcc         = fmt.pixelformat,
+            .width          = params.width,
+            .height         = params.height,
+            .stride         = fmt.pixelformat == v4l2::fourcc("MJPG") ? 0 : fmt.bytesperline,
+            .max_frame_size = params.buffers[0].length,
+        };
+        co_ensure_v(co_await loader.thread.run([&]() {
+            return rc->init_raw(path, format, *params.args);
+        }));
+        if(standby && record_context) {
+            co_return true;
+        }
+        record_context = std::move(rc);
+    } else if(params.args->copy_video) {
+        co_ensure_v(co_await loader.thread.run([&]() {
+            return rc->init_copy(path, params.width, params.height, *params.args);
+        }));
+        if(standby && record_context) {
+            co_return true;
+        }
+        record_context = std::move(rc);
+    } else {
+        co_unwrap_v(pix_fmt, frame.get_pixel_format());
+        co_ensure_v(co_await loader.thread.run([&]() {
+            return rc->init(path, pix_fmt, params.width, params.height, params.fps, *params.args);
+        }));
+        if(standby && record_context) {
+            co_return true;
+        }
+        record_context = std::move(rc);
+    }
+    co_return true;
+}
+
 auto Camera::dispatcher_main() -> coop::Async<bool> {
     constexpr static auto error_value = false;
 
@@ -120,7 +311,15 @@ loop:
 }
 
 auto Camera::run(CameraParams params) -> coop::Async<void> {
-    this->params = std::move(params);
+    this->params    = std::move(params);
+    preroll_pending = this->params.args->preroll > 0;
+    photo_saver.init(0, size_t(this->params.args->burst_mbytes) * 1024 * 1024);
+    if(this->params.args->use_v4l2_encoder) {
+        // picked once at startup and away from the capture loop, the benchmark takes seconds per node
+        v4l2_encoder_node = std::async(std::launch::async, [this]() {
+                                return ff::select_v4l2_encoder(this->params.width, this->params.height, this->params.args->encoder_config, false);
+                            }).share();
+    }
     auto& runner = *co_await coop::reveal_runner();
     runner.push_task(dispatcher_main(), &dispatcher);
 }
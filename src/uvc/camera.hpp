@@ -1,4 +1,7 @@
 #pragma once
+#include <future>
+#include <mutex>
+
 #include <coop/generator.hpp>
 #include <coop/promise.hpp>
 #include <coop/single-event.hpp>
@@ -7,7 +10,9 @@
 #include "../file.hpp"
 #include "../gawl/wayland/eglobject.hpp"
 #include "../gawl/wayland/window.hpp"
+#include "../photo-saver.hpp"
 #include "../record-context.hpp"
+#include "../v4l2-encoder/encoder.hpp"
 #include "../v4l2.hpp"
 #include "../window.hpp"
 
@@ -33,13 +38,28 @@ class Camera {
         coop::TaskHandle   task;
     };
 
-    CameraParams                    params;
-    std::shared_ptr<RecordContext>  record_context;
-    std::array<Loader, num_buffers> loaders;
-    coop::TaskHandle                dispatcher;
-    size_t                          current_frame_count = 0;
-    size_t                          front_frame_count   = 0;
+    using EncoderNode = std::shared_future<std::optional<std::string>>;
+
+    CameraParams                     params;
+    std::shared_ptr<RecordContext>   record_context;
+    std::shared_ptr<ff::V4L2Encoder> v4l2_encoder;      // --video-codec v4l2-*
+    std::mutex                       v4l2_encoder_lock; // loaders feed it from their own threads
+    EncoderNode                      v4l2_encoder_node; // chosen in the background by run()
+    std::array<Loader, num_buffers>  loaders;
+    coop::TaskHandle                 dispatcher;
+    size_t                           current_frame_count = 0;
+    size_t                           front_frame_count   = 0;
+    bool                             preroll_pending     = false; // --preroll, start encoding on the next frame
+    bool                             warming             = false; // a loader is creating the standby context
+    bool                             standby_failed      = false; // not retried until movie mode is entered again
+    Burst                            burst;
+    PhotoSaver                       photo_saver;
 
+    auto write_raw(RecordContext& rc, const v4l2_pix_format& fmt, Frame::ByteArray byte_array) -> void;
+    // on the loader thread before the buffer is requeued, the encoders copy from it
+    auto encode_frame(RecordContext& rc, ff::V4L2Encoder* enc, const Frame& frame, Frame::ByteArray byte_array) -> bool;
+    auto create_record_context(Loader& loader, const Frame& frame, std::string path, bool standby) -> coop::Async<bool>;
+    auto stop_recording(Loader& loader) -> coop::Async<void>;
     auto loader_main(size_t index) -> coop::Async<void>;
     auto dispatcher_main() -> coop::Async<bool>;
 
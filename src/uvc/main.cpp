@@ -37,6 +37,8 @@ auto main(const int argc, const char* const* const argv) -> int {
         return 0;
     }
 
+    ensure(!args.use_v4l2_encoder || args.pixel_format.data == v4l2::fourcc("NV12"), "the v4l2 encoder needs --pix-format NV12");
+    ensure(!args.copy_video || args.pixel_format.data == v4l2::fourcc("MJPG"), "--video-codec copy needs --pix-format MJPG");
     ensure(v4l2::set_format(fd, args.pixel_format.data, args.width, args.height));
     ensure(v4l2::set_interval(fd, 1, args.fps));
 
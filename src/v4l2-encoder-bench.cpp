@@ -0,0 +1,82 @@
+#include <chrono>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "macros/assert.hpp"
+#include "macros/unwrap.hpp"
+#include "util/charconv.hpp"
+#include "v4l2-encoder/encoder.hpp"
+
+// runs synthetic nv12 frames through V4L2Encoder's copy path with vicodec's fwht, no encoder hardware needed
+// load vicodec first, NODE defaults to the one select_v4l2_encoder() picks
+// fwht can be encoded but not recorded, so this is the only way to run it
+// usage: v4l2-encoder-bench [NODE [WIDTH HEIGHT FPS SECONDS]]
+auto main(const int argc, const char* const* const argv) -> int {
+    ensure(argc == 1 || argc == 2 || argc == 6, "usage: {} [NODE [WIDTH HEIGHT FPS SECONDS]]", argv[0]);
+    auto width   = 1280;
+    auto height  = 720;
+    auto fps     = 30;
+    auto seconds = 5;
+    if(argc == 6) {
+        unwrap(w, from_chars<int>(argv[2]));
+        unwrap(h, from_chars<int>(argv[3]));
+        unwrap(f, from_chars<int>(argv[4]));
+        unwrap(s, from_chars<int>(argv[5]));
+        width   = w;
+        height  = h;
+        fps     = f;
+        seconds = s;
+    }
+
+    const auto config = ff::V4L2EncoderConfig{.codec = ff::V4L2Codec::FWHT};
+    auto       node   = std::string();
+    if(argc >= 2) {
+        node = argv[1];
+    } else {
+        unwrap_mut(selected, ff::select_v4l2_encoder(width, height, config, false));
+        node = std::move(selected);
+    }
+    auto enc = ff::V4L2Encoder();
+    ensure(enc.init_cpu(node.data(), width, height, fps, config));
+
+    // a few distinct frames, so that the encoder cannot shortcut repeated data
+    const auto luma   = size_t(width) * height;
+    auto       frames = std::vector<std::vector<std::byte>>(4);
+    for(auto i = 0uz; i < frames.size(); i += 1) {
+        frames[i].resize(luma + luma / 2);
+        for(auto j = 0uz; j < frames[i].size(); j += 1) {
+            frames[i][j] = std::byte((j * 7 + i * 31) & 0xff);
+        }
+    }
+
+    auto       packets   = 0;
+    auto       bytes     = size_t(0);
+    auto       last_pts  = int64_t(-1);
+    auto       ordered   = true;
+    const auto on_packet = [&](ff::V4L2Encoder::Packet& p) {
+        packets += 1;
+        bytes += p.size;
+        ordered &= p.pts_us > last_pts;
+        last_pts = p.pts_us;
+    };
+
+    std::println("encoding {}x{} nv12 at {}fps for {}s on {}", width, height, fps, seconds, node);
+    const auto interval = std::chrono::microseconds(1000000 / fps);
+    const auto begin    = std::chrono::steady_clock::now();
+    auto       next     = begin;
+    for(auto i = 0; i < fps * seconds; i += 1) {
+        const auto& frame = frames[i % frames.size()];
+        ensure(enc.encode(frame.data(), width, frame.data() + luma, width, int64_t(i) * interval.count(), on_packet));
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+    ensure(enc.drain(on_packet));
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::println("{} packets for {} frames, {:.0f} KiB/s, {:.1f}fps", packets, fps * seconds, bytes / elapsed / 1024, packets / elapsed);
+    ensure(packets > 0, "no packet came out");
+    ensure(ordered, "packets out of order");
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <array>
+#include <utility>
+
+#include "config.hpp"
+
+namespace ff {
+namespace {
+template <size_t N>
+auto find_value(const std::array<std::pair<std::string_view, int>, N>& table, const std::string_view str) -> std::optional<int> {
+    for(const auto& [name, value] : table) {
+        if(name == str) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+const auto codecs = std::array{
+    std::pair<std::string_view, V4L2Codec>{"h264", V4L2Codec::H264},
+    std::pair<std::string_view, V4L2Codec>{"hevc", V4L2Codec::HEVC},
+    std::pair<std::string_view, V4L2Codec>{"vp8", V4L2Codec::VP8},
+    std::pair<std::string_view, V4L2Codec>{"vp9", V4L2Codec::VP9},
+    std::pair<std::string_view, V4L2Codec>{"fwht", V4L2Codec::FWHT},
+};
+} // namespace
+
+auto v4l2_codec_fourcc(const V4L2Codec codec) -> uint32_t {
+    switch(codec) {
+    case V4L2Codec::H264:
+        return V4L2_PIX_FMT_H264;
+    case V4L2Codec::HEVC:
+        return V4L2_PIX_FMT_HEVC;
+    case V4L2Codec::VP8:
+        return V4L2_PIX_FMT_VP8;
+    case V4L2Codec::VP9:
+        return V4L2_PIX_FMT_VP9;
+    case V4L2Codec::FWHT:
+        return V4L2_PIX_FMT_FWHT;
+    }
+    return 0;
+}
+
+auto v4l2_codec_name(const V4L2Codec codec) -> const char* {
+    for(const auto& [name, value] : codecs) {
+        if(value == codec) {
+            return name.data();
+        }
+    }
+    return "unknown";
+}
+
+auto parse_v4l2_codec(const std::string_view str) -> std::optional<V4L2Codec> {
+    for(const auto& [name, value] : codecs) {
+        if(name == str) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+auto parse_bitrate_mode(const std::string_view str) -> std::optional<int> {
+    static const auto table = std::array{
+        std::pair<std::string_view, int>{"vbr", V4L2_MPEG_VIDEO_BITRATE_MODE_VBR},
+        std::pair<std::string_view, int>{"cbr", V4L2_MPEG_VIDEO_BITRATE_MODE_CBR},
+        std::pair<std::string_view, int>{"cq", V4L2_MPEG_VIDEO_BITRATE_MODE_CQ},
+    };
+    return find_value(table, str);
+}
+
+auto parse_h264_profile(const std::string_view str) -> std::optional<int> {
+    static const auto table = std::array{
+        std::pair<std::string_view, int>{"baseline", V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE},
+        std::pair<std::string_view, int>{"constrained-baseline", V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE},
+        std::pair<std::string_view, int>{"main", V4L2_MPEG_VIDEO_H264_PROFILE_MAIN},
+        std::pair<std::string_view, int>{"high", V4L2_MPEG_VIDEO_H264_PROFILE_HIGH},
+    };
+    return find_value(table, str);
+}
+
+auto parse_h264_level(const std::string_view str) -> std::optional<int> {
+    static const auto table = std::array{
+        std::pair<std::string_view, int>{"1.0", V4L2_MPEG_VIDEO_H264_LEVEL_1_0},
+        std::pair<std::string_view, int>{"1b", V4L2_MPEG_VIDEO_H264_LEVEL_1B},
+        std::pair<std::string_view, int>{"1.1", V4L2_MPEG_VIDEO_H264_LEVEL_1_1},
+        std::pair<std::string_view, int>{"1.2", V4L2_MPEG_VIDEO_H264_LEVEL_1_2},
+        std::pair<std::string_view, int>{"1.3", V4L2_MPEG_VIDEO_H264_LEVEL_1_3},
+        std::pair<std::string_view, int>{"2.0", V4L2_MPEG_VIDEO_H264_LEVEL_2_0},
+        std::pair<std::string_view, int>{"2.1", V4L2_MPEG_VIDEO_H264_LEVEL_2_1},
+        std::pair<std::string_view, int>{"2.2", V4L2_MPEG_VIDEO_H264_LEVEL_2_2},
+        std::pair<std::string_view, int>{"3.0", V4L2_MPEG_VIDEO_H264_LEVEL_3_0},
+        std::pair<std::string_view, int>{"3.1", V4L2_MPEG_VIDEO_H264_LEVEL_3_1},
+        std::pair<std::string_view, int>{"3.2", V4L2_MPEG_VIDEO_H264_LEVEL_3_2},
+        std::pair<std::string_view, int>{"4.0", V4L2_MPEG_VIDEO_H264_LEVEL_4_0},
+        std::pair<std::string_view, int>{"4.1", V4L2_MPEG_VIDEO_H264_LEVEL_4_1},
+        std::pair<std::string_view, int>{"4.2", V4L2_MPEG_VIDEO_H264_LEVEL_4_2},
+        std::pair<std::string_view, int>{"5.0", V4L2_MPEG_VIDEO_H264_LEVEL_5_0},
+        std::pair<std::string_view, int>{"5.1", V4L2_MPEG_VIDEO_H264_LEVEL_5_1},
+    };
+    return find_value(table, str);
+}
+} // namespace ff
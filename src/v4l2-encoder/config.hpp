@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include <linux/videodev2.h>
+
+namespace ff {
+enum class V4L2Codec {
+    H264,
+    HEVC,
+    VP8,
+    VP9,
+    FWHT, // vicodec, for testing without hardware
+};
+
+// values are V4L2 control values, -1 leaves the driver default
+struct V4L2EncoderConfig {
+    V4L2Codec codec = V4L2Codec::H264;
+
+    int bitrate      = 0; // bits per second, 0 = 200kbps per fps
+    int bitrate_mode = V4L2_MPEG_VIDEO_BITRATE_MODE_VBR;
+    int quality      = -1; // 1..100, constant quality mode only
+    int qp_min       = -1;
+    int qp_max       = -1;
+    int gop          = 0; // frames between idrs, 0 = one second
+    int b_frames     = -1;
+    int slice_mbs    = 0; // macroblocks per slice, 0 = one slice per frame
+    int profile      = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH; // h.264 only
+    int level        = -1;                                // h.264 only
+};
+
+auto v4l2_codec_fourcc(V4L2Codec codec) -> uint32_t;
+auto v4l2_codec_name(V4L2Codec codec) -> const char*;
+// "h264", "hevc", "vp8", "vp9" or "fwht"
+auto parse_v4l2_codec(std::string_view str) -> std::optional<V4L2Codec>;
+
+// "cbr", "vbr" or "cq"
+auto parse_bitrate_mode(std::string_view str) -> std::optional<int>;
+// "baseline", "constrained-baseline", "main" or "high"
+auto parse_h264_profile(std::string_view str) -> std::optional<int>;
+// "1.0", "1b", "1.1" ... "5.1"
+auto parse_h264_level(std::string_view str) -> std::optional<int>;
+} // namespace ff
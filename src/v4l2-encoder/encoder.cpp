@@ -1,13 +1,19 @@
 #include <cerrno>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <print>
+#include <string>
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
 #define GL_GLEXT_PROTOTYPES
@@ -39,6 +45,7 @@ auto p_glEGLImageTargetTexture2DOES = PFNGLEGLIMAGETARGETTEXTURE2DOESPROC();
 auto p_eglCreateSyncKHR             = PFNEGLCREATESYNCKHRPROC();
 auto p_eglClientWaitSyncKHR         = PFNEGLCLIENTWAITSYNCKHRPROC();
 auto p_eglDestroySyncKHR            = PFNEGLDESTROYSYNCKHRPROC();
+auto p_eglDupNativeFenceFDANDROID   = PFNEGLDUPNATIVEFENCEFDANDROIDPROC();
 
 auto ensure_api_entries() -> bool {
     if(p_eglCreateImageKHR != NULL) {
@@ -51,6 +58,7 @@ auto ensure_api_entries() -> bool {
     p_eglCreateSyncKHR             = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
     p_eglClientWaitSyncKHR         = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
     p_eglDestroySyncKHR            = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+    p_eglDupNativeFenceFDANDROID   = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)eglGetProcAddress("eglDupNativeFenceFDANDROID");
     ensure(p_eglCreateImageKHR && p_eglDestroyImageKHR && p_glEGLImageTargetTexture2DOES);
     return true;
 }
@@ -76,24 +84,138 @@ auto xioctl(const int fd, const unsigned long req, void* const arg) -> int {
     } while(r < 0 && errno == EINTR);
     return r;
 }
+
+auto find_render_node(const EGLDisplay dpy) -> std::string {
+    const auto query_display = (PFNEGLQUERYDISPLAYATTRIBEXTPROC)eglGetProcAddress("eglQueryDisplayAttribEXT");
+    const auto query_device  = (PFNEGLQUERYDEVICESTRINGEXTPROC)eglGetProcAddress("eglQueryDeviceStringEXT");
+    auto       device        = EGLAttrib();
+    if(query_display != nullptr && query_device != nullptr && query_display(dpy, EGL_DEVICE_EXT, &device)) {
+        if(const auto node = query_device(EGLDeviceEXT(device), EGL_DRM_RENDER_NODE_FILE_EXT); node != nullptr) {
+            return node;
+        }
+    }
+    WARN("cannot query the render node of the egl display, using renderD128");
+    return "/dev/dri/renderD128";
+}
+
+auto qp_range_controls(const V4L2Codec codec) -> std::array<uint32_t, 2> {
+    switch(codec) {
+    case V4L2Codec::H264:
+        return {V4L2_CID_MPEG_VIDEO_H264_MIN_QP, V4L2_CID_MPEG_VIDEO_H264_MAX_QP};
+    case V4L2Codec::HEVC:
+        return {V4L2_CID_MPEG_VIDEO_HEVC_MIN_QP, V4L2_CID_MPEG_VIDEO_HEVC_MAX_QP};
+    case V4L2Codec::VP8:
+    case V4L2Codec::VP9:
+        return {V4L2_CID_MPEG_VIDEO_VPX_MIN_QP, V4L2_CID_MPEG_VIDEO_VPX_MAX_QP};
+    default:
+        return {0, 0};
+    }
+}
+
+auto queue_capture(const int fd, const uint32_t index) -> bool {
+    auto qp     = v4l2_plane();
+    auto qb     = v4l2_buffer();
+    qb.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    qb.memory   = V4L2_MEMORY_MMAP;
+    qb.index    = index;
+    qb.length   = 1;
+    qb.m.planes = &qp;
+    return xioctl(fd, VIDIOC_QBUF, &qb) == 0;
+}
+
+auto has_format(const int fd, const v4l2_buf_type type, const uint32_t fourcc) -> bool {
+    auto desc = v4l2_fmtdesc();
+    desc.type = type;
+    for(desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index += 1) {
+        if(desc.pixelformat == fourcc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// feeds flat frames as fast as the encoder takes them, returns encoded frames per second
+auto measure_encoder(const char* const node, const int width, const int height, const V4L2EncoderConfig& config, const bool gpu_input) -> std::optional<double> {
+    constexpr auto frames  = 30;
+    constexpr auto timeout = std::chrono::seconds(5);
+
+    auto enc = V4L2Encoder();
+    if(gpu_input) {
+        ensure(enc.init(node, width, height, 30, config));
+    } else {
+        ensure(enc.init_cpu(node, width, height, 30, config));
+    }
+
+    auto       count     = 0;
+    const auto on_packet = [&count](V4L2Encoder::Packet&) { count += 1; };
+    const auto render    = [](const GLuint fbo_y, const GLuint fbo_uv, const int width, const int height) {
+        glClearColor(0.5, 0.5, 0.5, 1.0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_y);
+        glViewport(0, 0, width, height);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_uv);
+        glViewport(0, 0, width / 2, height / 2);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    };
+    const auto gray = std::vector<std::byte>(gpu_input ? 0 : size_t(width) * height, std::byte(128)); // serves both planes
+
+    const auto begin = std::chrono::steady_clock::now();
+    for(auto pts = 0; count < frames && std::chrono::steady_clock::now() - begin < timeout; pts += 1) {
+        const auto pts_us = pts * 1000000 / 30;
+        if(gpu_input) {
+            ensure(enc.encode(render, pts_us, on_packet));
+        } else {
+            ensure(enc.encode(gray.data(), width, gray.data(), width, pts_us, on_packet));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1)); // busy buffers drop the frame, do not spin
+    }
+    ensure(enc.drain(on_packet));
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return count / elapsed;
+}
 } // namespace
 
-auto V4L2H264Encoder::reclaim_output() -> void {
+auto V4L2Encoder::CaptureBuffers::release(void* const opaque, uint8_t* /*data*/) -> void {
+    auto& buf  = *static_cast<Buffer*>(opaque);
+    auto& caps = *buf.owner;
+    if(queue_capture(caps.vfd, buf.index)) {
+        caps.queued += 1;
+    }
+    caps.unref();
+}
+
+auto V4L2Encoder::CaptureBuffers::unref() -> void {
+    if((refs -= 1) == 0) {
+        delete this;
+    }
+}
+
+V4L2Encoder::CaptureBuffers::~CaptureBuffers() {
+    for(const auto& buf : buffers) {
+        if(buf.ptr && buf.ptr != MAP_FAILED) munmap(buf.ptr, buf.len);
+    }
+    if(vfd >= 0) close(vfd);
+}
+
+auto V4L2Encoder::reclaim_output() -> void {
 loop:
     auto pl     = v4l2_plane();
     auto db     = v4l2_buffer();
     db.type     = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    db.memory   = V4L2_MEMORY_DMABUF;
+    db.memory   = out_memory;
     db.length   = 1;
     db.m.planes = &pl;
     if(xioctl(vfd, VIDIOC_DQBUF, &db) < 0) {
         return;
     }
-    out_bufs[db.index].state = OutBuf::State::Free;
+    auto& state = out_bufs[db.index].state;
+    state       = OutBuf::State::Free;
+    state.notify_all(); // wait_released()
     goto loop;
 }
 
-auto V4L2H264Encoder::drain_capture(const PacketCallback& on_packet) -> void {
+auto V4L2Encoder::drain_capture() -> bool {
 loop:
     auto pl     = v4l2_plane();
     auto db     = v4l2_buffer();
@@ -102,33 +224,36 @@ loop:
     db.length   = 1;
     db.m.planes = &pl;
     if(xioctl(vfd, VIDIOC_DQBUF, &db) < 0) {
-        return;
+        return false;
     }
+    caps->queued -= 1;
+    // lend the buffer as long as the encoder keeps enough of them, copy when the muxer holds on to too many
+    const auto lend = pl.bytesused > 0 && caps->queued >= int(caps->count / 2);
     if(pl.bytesused > 0) {
-        on_packet(Packet{
-            .data     = static_cast<const std::byte*>(cap_ptr[db.index]),
+        auto packet = CodedPacket{
             .size     = pl.bytesused,
             .pts_us   = int64_t(db.timestamp.tv_sec) * 1000000 + db.timestamp.tv_usec,
             .keyframe = (db.flags & V4L2_BUF_FLAG_KEYFRAME) != 0,
-        });
+        };
+        if(lend) {
+            packet.lent = db.index;
+            caps->refs += 1;
+        } else {
+            const auto data = static_cast<const std::byte*>(caps->buffers[db.index].ptr);
+            packet.copy     = std::vector<std::byte>(data, data + pl.bytesused);
+        }
+        backlog.push_back(std::move(packet));
     }
     if(db.flags & V4L2_BUF_FLAG_LAST) {
-        return;
+        return true;
+    }
+    if(!lend && queue_capture(vfd, db.index)) {
+        caps->queued += 1;
     }
-
-    auto qp     = v4l2_plane();
-    auto qb     = v4l2_buffer();
-    qb.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    qb.memory   = V4L2_MEMORY_MMAP;
-    qb.index    = db.index;
-    qb.length   = 1;
-    qb.m.planes = &qp;
-    xioctl(vfd, VIDIOC_QBUF, &qb);
-
     goto loop;
 }
 
-auto V4L2H264Encoder::render_into(OutBuf& b, const GLuint src_rgba) -> void {
+auto V4L2Encoder::pack_rgba(const GLuint src_rgba, const GLuint fbo_y, const GLuint fbo_uv) -> void {
     static const GLfloat verts[] = {-1, -1, 0, 0, 1, -1, 1, 0, 1, 1, 1, 1, -1, 1, 0, 1};
     static const GLuint  elems[] = {0, 1, 2, 2, 3, 0};
 
@@ -146,43 +271,73 @@ auto V4L2H264Encoder::render_into(OutBuf& b, const GLuint src_rgba) -> void {
     glVertexAttribPointer(tc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, verts + 2);
     glEnableVertexAttribArray(tc);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, b.fbo_y);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_y);
     glViewport(0, 0, coded_w, coded_h);
     glUniform2i(loc_dstsize, coded_w, coded_h);
     glUniform1i(loc_plane, 0);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, elems);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, b.fbo_uv);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_uv);
     glViewport(0, 0, coded_w / 2, coded_h / 2);
     glUniform2i(loc_dstsize, coded_w / 2, coded_h / 2);
     glUniform1i(loc_plane, 1);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, elems);
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+auto V4L2Encoder::render_into(OutBuf& b, const RenderCallback& render) -> void {
+    render(b.fbo_y, b.fbo_uv, coded_w, coded_h);
 
+    if(have_native_fence) {
+        const EGLint attrs[] = {EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID, EGL_NONE};
+        if(const auto sync = p_eglCreateSyncKHR(egl_dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, attrs); sync != EGL_NO_SYNC_KHR) {
+            glFlush(); // the fd is only available once the fence is submitted
+            b.fence_fd = p_eglDupNativeFenceFDANDROID(egl_dpy, sync);
+            p_eglDestroySyncKHR(egl_dpy, sync);
+        }
+        if(b.fence_fd >= 0) {
+#ifdef DMA_BUF_IOCTL_IMPORT_SYNC_FILE
+            // let implicitly synchronized consumers of the dmabuf see the pending write too
+            if(have_import_sync_file) {
+                auto arg  = dma_buf_import_sync_file();
+                arg.flags = DMA_BUF_SYNC_WRITE;
+                arg.fd    = b.fence_fd;
+                if(xioctl(b.fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &arg) != 0) {
+                    WARN("DMA_BUF_IOCTL_IMPORT_SYNC_FILE not supported: {}", strerror(errno));
+                    have_import_sync_file = false;
+                }
+            }
+#endif
+            return;
+        }
+    }
     if(have_fence) {
-        glFlush();
         b.fence = p_eglCreateSyncKHR(egl_dpy, EGL_SYNC_FENCE_KHR, nullptr);
         if(b.fence == EGL_NO_SYNC_KHR) {
             b.fence = nullptr;
             glFinish();
+        } else {
+            glFlush(); // submit the fence too, the encoder thread waits on it without flushing
         }
     } else {
         glFinish();
     }
 }
 
-auto V4L2H264Encoder::qbuf_output(const int idx) -> bool {
+auto V4L2Encoder::qbuf_output(const int idx) -> bool {
     auto& buf = out_bufs[idx];
 
     auto op      = v4l2_plane();
-    op.length    = sizeimage;
     op.bytesused = sizeimage;
-    op.m.fd      = buf.fd;
+    if(out_memory == V4L2_MEMORY_DMABUF) {
+        op.length = out_length;
+        op.m.fd   = buf.fd;
+    }
 
     auto ob              = v4l2_buffer();
     ob.type              = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    ob.memory            = V4L2_MEMORY_DMABUF;
+    ob.memory            = out_memory;
     ob.index             = idx;
     ob.length            = 1;
     ob.m.planes          = &op;
@@ -195,60 +350,170 @@ auto V4L2H264Encoder::qbuf_output(const int idx) -> bool {
     return true;
 }
 
-auto V4L2H264Encoder::flush_pending(const bool block) -> void {
+auto V4L2Encoder::flush_pending(const bool block) -> void {
     while(!pending.empty()) {
         const auto idx = pending.front();
         auto&      buf = out_bufs[idx];
-        if(buf.fence != nullptr) {
-            const auto timeout = block ? EGL_FOREVER_KHR : EGLTimeKHR(0);
-            const auto r       = p_eglClientWaitSyncKHR(egl_dpy, buf.fence, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, timeout);
-            if(r == EGL_TIMEOUT_EXPIRED_KHR) {
-                return; // front not ready yet
+        if(buf.fence_fd >= 0) {
+            // a sync_file becomes readable once signaled
+            auto pfd = pollfd{.fd = buf.fence_fd, .events = POLLIN, .revents = 0};
+            if(poll(&pfd, 1, block ? -1 : 0) <= 0) {
+                return; // front not ready yet, service_main() polls it
             }
+            close(buf.fence_fd);
+            buf.fence_fd = -1;
+        } else if(buf.fence != nullptr) {
+            // no pollable fd, so this waits even when !block.
+            // render_into() flushed after creating the fence, the wait cannot stall on unsubmitted work
+            p_eglClientWaitSyncKHR(egl_dpy, buf.fence, 0, EGL_FOREVER_KHR);
             p_eglDestroySyncKHR(egl_dpy, buf.fence);
             buf.fence = nullptr;
         }
-        pending.erase(pending.begin());
+        pending.pop_front();
         qbuf_output(idx);
     }
 }
 
-auto V4L2H264Encoder::init(const char* const venus_node, const int width_, const int height_, const int bitrate, const int fps) -> bool {
-    width  = width_;
-    height = height_;
-    ensure((width % 2) == 0 && (height % 2) == 0);
+auto V4L2Encoder::stop_stream() -> void {
+    auto ec = v4l2_encoder_cmd();
+    ec.cmd  = V4L2_ENC_CMD_STOP;
+    ioctl(vfd, VIDIOC_ENCODER_CMD, &ec);
 
-    egl_dpy = eglGetCurrentDisplay();
-    ensure(egl_dpy != EGL_NO_DISPLAY);
+    for(auto i = 0; i < 64; i += 1) {
+        auto pfd = pollfd{.fd = vfd, .events = POLLIN, .revents = 0};
+        if(poll(&pfd, 1, 200) <= 0) {
+            break;
+        }
+        if(drain_capture()) {
+            break;
+        }
+    }
+}
 
-    ensure(ensure_api_entries());
+auto V4L2Encoder::service_main() -> void {
+    auto vfd_idle = false; // poll() reports POLLERR while neither queue has buffers
+loop:
+    while(auto idx = submissions.pop()) {
+        pending.push_back(*idx);
+        vfd_idle = false;
+    }
+    if(stopping) {
+        flush_pending(true);
+        stop_stream();
+        return;
+    }
+    flush_pending(false);
 
-    const auto egl_exts = eglQueryString(egl_dpy, EGL_EXTENSIONS);
+    // buffers are queued in order, so only the oldest fence matters
+    const auto fence_fd = pending.empty() ? -1 : out_bufs[pending.front()].fence_fd;
 
-    have_fence = egl_exts != nullptr &&
-                 strstr(egl_exts, "EGL_KHR_fence_sync") != nullptr &&
-                 p_eglCreateSyncKHR != nullptr &&
-                 p_eglClientWaitSyncKHR != nullptr &&
-                 p_eglDestroySyncKHR != nullptr;
-    if(!have_fence) {
-        WARN("fence extension not supported");
+    auto fds = std::array{
+        pollfd{.fd = wake_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = vfd_idle ? -1 : vfd, .events = POLLIN | POLLOUT, .revents = 0},
+        pollfd{.fd = fence_fd, .events = POLLIN, .revents = 0},
+    };
+    if(poll(fds.data(), fds.size(), -1) < 0) {
+        if(errno != EINTR) {
+            WARN("poll failed: {}", strerror(errno));
+            return;
+        }
+        goto loop;
+    }
+    if(fds[0].revents & POLLIN) {
+        auto count = uint64_t();
+        read(wake_fd, &count, sizeof(count));
+    }
+    if(fds[1].revents & POLLERR) {
+        vfd_idle = true;
+    }
+    if(fds[1].revents & POLLOUT) {
+        reclaim_output();
     }
+    if(fds[1].revents & POLLIN) {
+        drain_capture();
+    }
+    while(!backlog.empty() && packets.push(std::move(backlog.front()))) {
+        backlog.pop_front();
+    }
+    goto loop;
+}
 
-    drm_fd = open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
-    ensure(drm_fd >= 0, "open render node: {}", strerror(errno));
-    gbm = gbm_create_device(drm_fd);
-    ensure(gbm != nullptr);
-    vfd = open(venus_node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
-    ensure(vfd >= 0, "no Venus H.264 encoder node found");
+auto V4L2Encoder::wake_service() -> void {
+    const auto count = uint64_t(1);
+    write(wake_fd, &count, sizeof(count));
+}
+
+auto V4L2Encoder::deliver(CodedPacket& packet, const PacketCallback& on_packet) -> void {
+    auto p = Packet{
+        .data     = packet.copy.data(),
+        .size     = packet.size,
+        .pts_us   = packet.pts_us,
+        .keyframe = packet.keyframe,
+    };
+    if(packet.lent >= 0) {
+        auto& buf = caps->buffers[packet.lent];
+        p.data    = static_cast<const std::byte*>(buf.ptr);
+        p.release = CaptureBuffers::release;
+        p.opaque  = &buf;
+    }
+    on_packet(p);
+    if(p.release != nullptr) {
+        p.release(p.opaque, (uint8_t*)p.data);
+    }
+}
+
+auto V4L2Encoder::deliver_packets(const PacketCallback& on_packet) -> void {
+    while(auto packet = packets.pop()) {
+        deliver(*packet, on_packet);
+    }
+}
+
+auto V4L2Encoder::apply_config(const V4L2EncoderConfig& config, const int fps) -> void {
+    // failures are not fatal, the driver keeps its defaults
+    set_control(V4L2_CID_MPEG_VIDEO_BITRATE_MODE, config.bitrate_mode);
+    set_control(V4L2_CID_MPEG_VIDEO_BITRATE, config.bitrate > 0 ? config.bitrate : 200000 * fps);
+    if(config.bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CQ && config.quality >= 0) {
+        set_control(V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY, config.quality);
+    }
+    if(const auto [min, max] = qp_range_controls(config.codec); min != 0) {
+        if(config.qp_min >= 0) {
+            set_control(min, config.qp_min);
+        }
+        if(config.qp_max >= 0) {
+            set_control(max, config.qp_max);
+        }
+    }
+    set_control(V4L2_CID_MPEG_VIDEO_GOP_SIZE, config.gop > 0 ? config.gop : fps);
+    if(config.b_frames >= 0) {
+        set_control(V4L2_CID_MPEG_VIDEO_B_FRAMES, config.b_frames);
+    }
+    if(config.slice_mbs > 0) {
+        set_control(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB);
+        set_control(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, config.slice_mbs);
+    }
+    if(config.codec == V4L2Codec::H264) {
+        set_control(V4L2_CID_MPEG_VIDEO_H264_PROFILE, config.profile);
+        if(config.level >= 0) {
+            set_control(V4L2_CID_MPEG_VIDEO_H264_LEVEL, config.level);
+        }
+    }
+}
+
+auto V4L2Encoder::open_device(const char* const node, const int fps, const V4L2EncoderConfig& config, const int stride_hint) -> bool {
+    vfd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    ensure(vfd >= 0, "open encoder node {}: {}", node, strerror(errno));
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ensure(wake_fd >= 0, "eventfd: {}", strerror(errno));
 
     // output (nv12 to encoder)
-    auto ofmt                   = v4l2_format();
-    ofmt.type                   = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    ofmt.fmt.pix_mp.width       = width;
-    ofmt.fmt.pix_mp.height      = height;
-    ofmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
-    ofmt.fmt.pix_mp.num_planes  = 1;
-    ofmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+    auto ofmt                                 = v4l2_format();
+    ofmt.type                                 = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    ofmt.fmt.pix_mp.width                     = width;
+    ofmt.fmt.pix_mp.height                    = height;
+    ofmt.fmt.pix_mp.pixelformat               = V4L2_PIX_FMT_NV12;
+    ofmt.fmt.pix_mp.num_planes                = 1;
+    ofmt.fmt.pix_mp.field                     = V4L2_FIELD_NONE;
+    ofmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride_hint; // 0 lets the driver choose
     ensure(xioctl(vfd, VIDIOC_S_FMT, &ofmt) == 0, "S_FMT out: {}", strerror(errno));
     coded_w   = ofmt.fmt.pix_mp.width;
     coded_h   = ofmt.fmt.pix_mp.height;
@@ -256,12 +521,12 @@ auto V4L2H264Encoder::init(const char* const venus_node, const int width_, const
     sizeimage = ofmt.fmt.pix_mp.plane_fmt[0].sizeimage;
     uv_off    = ystride * coded_h;
 
-    // capture (h264)
+    // capture (coded)
     auto cfmt                              = v4l2_format();
     cfmt.type                              = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
     cfmt.fmt.pix_mp.width                  = width;
     cfmt.fmt.pix_mp.height                 = height;
-    cfmt.fmt.pix_mp.pixelformat            = V4L2_PIX_FMT_H264;
+    cfmt.fmt.pix_mp.pixelformat            = v4l2_codec_fourcc(config.codec);
     cfmt.fmt.pix_mp.num_planes             = 1;
     cfmt.fmt.pix_mp.plane_fmt[0].sizeimage = 2 * 1024 * 1024;
     ensure(xioctl(vfd, VIDIOC_S_FMT, &cfmt) == 0, "S_FMT cap: {}", strerror(errno));
@@ -272,21 +537,99 @@ auto V4L2H264Encoder::init(const char* const venus_node, const int width_, const
     parm.parm.output.timeperframe.denominator = fps;
     ensure(xioctl(vfd, VIDIOC_S_PARM, &parm) == 0, "S_PARM out: {}", strerror(errno));
 
-    // controls (best-effort)
-    for(const auto ctrl : {
-            v4l2_control{V4L2_CID_MPEG_VIDEO_BITRATE, bitrate},
-            v4l2_control{V4L2_CID_MPEG_VIDEO_GOP_SIZE, fps},
-            v4l2_control{V4L2_CID_MPEG_VIDEO_H264_PROFILE, V4L2_MPEG_VIDEO_H264_PROFILE_HIGH},
-        }) {
-        ioctl(vfd, VIDIOC_S_CTRL, &ctrl);
-    }
+    apply_config(config, fps);
+    return true;
+}
 
-    // output buffers = imported dmabufs we render into
+auto V4L2Encoder::request_output(const uint32_t memory) -> bool {
     auto orb   = v4l2_requestbuffers();
     orb.count  = num_out;
     orb.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    orb.memory = V4L2_MEMORY_DMABUF;
-    ensure(xioctl(vfd, VIDIOC_REQBUFS, &orb) == 0, "REQBUFS out dmabuf: {}", strerror(errno));
+    orb.memory = memory;
+    ensure(xioctl(vfd, VIDIOC_REQBUFS, &orb) == 0, "REQBUFS out: {}", strerror(errno));
+    ensure(orb.count > 0);
+    out_count  = std::min(int(orb.count), num_out);
+    out_memory = memory;
+    return true;
+}
+
+auto V4L2Encoder::start_streaming() -> bool {
+    // capture buffers = mmap, queued up front
+    auto crb   = v4l2_requestbuffers();
+    crb.count  = num_cap;
+    crb.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    crb.memory = V4L2_MEMORY_MMAP;
+    ensure(xioctl(vfd, VIDIOC_REQBUFS, &crb) == 0, "REQBUFS cap mmap: {}", strerror(errno));
+    caps        = new CaptureBuffers();
+    caps->vfd   = fcntl(vfd, F_DUPFD_CLOEXEC, 0);
+    caps->count = std::min(crb.count, uint32_t(num_cap));
+    ensure(caps->vfd >= 0, "dup: {}", strerror(errno));
+    for(auto i = 0u; i < caps->count; i += 1) {
+        auto pl     = v4l2_plane();
+        auto qb     = v4l2_buffer();
+        qb.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        qb.memory   = V4L2_MEMORY_MMAP;
+        qb.index    = i;
+        qb.length   = 1;
+        qb.m.planes = &pl;
+        ensure(xioctl(vfd, VIDIOC_QUERYBUF, &qb) == 0, "QUERYBUF cap");
+        auto& buf = caps->buffers[i];
+        buf.owner = caps;
+        buf.index = i;
+        buf.len   = pl.length;
+        buf.ptr   = mmap(nullptr, pl.length, PROT_READ | PROT_WRITE, MAP_SHARED, vfd, pl.m.mem_offset);
+        ensure(buf.ptr != MAP_FAILED, "mmap cap");
+        ensure(xioctl(vfd, VIDIOC_QBUF, &qb) == 0, "QBUF cap init");
+        caps->queued += 1;
+    }
+
+    auto t = int(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    ensure(xioctl(vfd, VIDIOC_STREAMON, &t) == 0, "STREAMON out");
+    t = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    ensure(xioctl(vfd, VIDIOC_STREAMON, &t) == 0, "STREAMON cap");
+
+    service_thread = std::thread(&V4L2Encoder::service_main, this);
+    return true;
+}
+
+auto V4L2Encoder::init(const char* const node, const int width_, const int height_, const int fps, const V4L2EncoderConfig& config) -> bool {
+    width  = width_;
+    height = height_;
+    ensure((width % 2) == 0 && (height % 2) == 0);
+
+    egl_dpy = eglGetCurrentDisplay();
+    ensure(egl_dpy != EGL_NO_DISPLAY);
+
+    ensure(ensure_api_entries());
+
+    const auto egl_exts = eglQueryString(egl_dpy, EGL_EXTENSIONS);
+
+    have_fence = egl_exts != nullptr &&
+                 strstr(egl_exts, "EGL_KHR_fence_sync") != nullptr &&
+                 p_eglCreateSyncKHR != nullptr &&
+                 p_eglClientWaitSyncKHR != nullptr &&
+                 p_eglDestroySyncKHR != nullptr;
+    if(!have_fence) {
+        WARN("fence extension not supported");
+    }
+    have_native_fence = have_fence &&
+                        strstr(egl_exts, "EGL_ANDROID_native_fence_sync") != nullptr &&
+                        p_eglDupNativeFenceFDANDROID != nullptr;
+    if(have_fence && !have_native_fence) {
+        WARN("native fence extension not supported, waiting on the cpu");
+    }
+
+    // allocate from the gpu we render with
+    const auto render_node = find_render_node(egl_dpy);
+    drm_fd                 = open(render_node.data(), O_RDWR | O_CLOEXEC);
+    ensure(drm_fd >= 0, "open render node {}: {}", render_node, strerror(errno));
+    gbm = gbm_create_device(drm_fd);
+    ensure(gbm != nullptr);
+
+    ensure(open_device(node, fps, config, 0));
+    // output buffers = dmabufs we render into
+    ensure(request_output(V4L2_MEMORY_DMABUF));
+    out_length = sizeimage;
 
     // pack shader
     pack_prog = glCreateProgram();
@@ -300,7 +643,6 @@ auto V4L2H264Encoder::init(const char* const venus_node, const int width_, const
     loc_dstsize = glGetUniformLocation(pack_prog, "dst_size");
     loc_plane   = glGetUniformLocation(pack_prog, "plane");
 
-    out_bufs.resize(num_out);
     const auto rows = (sizeimage + ystride - 1) / ystride + 1;
     for(auto& buf : out_bufs) {
         buf.bo = gbm_bo_create(gbm, ystride, rows, GBM_FORMAT_R8, GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
@@ -344,108 +686,209 @@ auto V4L2H264Encoder::init(const char* const venus_node, const int width_, const
         ensure(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE, "UV fbo incomplete");
     }
 
-    // capture buffers = mmap, queued up front
-    auto crb   = v4l2_requestbuffers();
-    crb.count  = num_cap;
-    crb.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    crb.memory = V4L2_MEMORY_MMAP;
-    ensure(xioctl(vfd, VIDIOC_REQBUFS, &crb) == 0, "REQBUFS cap mmap: {}", strerror(errno));
-    cap_ptr.resize(crb.count);
-    cap_len.resize(crb.count);
-    for(auto i = 0u; i < crb.count; i += 1) {
+    return start_streaming();
+}
+
+auto V4L2Encoder::pick_free() -> int {
+    for(auto i = 0; i < out_count; i += 1) {
+        if(out_bufs[i].state == OutBuf::State::Free) {
+            return i;
+        }
+    }
+    // the encoder fell behind, keep the preview going instead of waiting for it
+    dropped_frames += 1;
+    return -1;
+}
+
+auto V4L2Encoder::submit(int idx) -> bool {
+    out_bufs[idx].state = OutBuf::State::Pending;
+    ensure(submissions.push(std::move(idx)));
+    wake_service();
+    return true;
+}
+
+auto V4L2Encoder::encode(const RenderCallback& render, const int64_t pts_us, const PacketCallback& on_packet) -> bool {
+    if(drained) {
+        return true;
+    }
+    deliver_packets(on_packet);
+
+    const auto idx = pick_free();
+    if(idx < 0) {
+        return true;
+    }
+    auto& buf  = out_bufs[idx];
+    buf.pts_us = pts_us;
+    render_into(buf, render); // sets buf.fence when fences are available
+    return submit(idx);
+}
+
+auto V4L2Encoder::encode(const GLuint src_rgba, const int64_t pts_us, const PacketCallback& on_packet) -> bool {
+    return encode([this, src_rgba](const GLuint fbo_y, const GLuint fbo_uv, int /*width*/, int /*height*/) { pack_rgba(src_rgba, fbo_y, fbo_uv); }, pts_us, on_packet);
+}
+
+auto V4L2Encoder::init_cpu(const char* const node, const int width_, const int height_, const int fps, const V4L2EncoderConfig& config, const int import_stride, const size_t import_length) -> bool {
+    width  = width_;
+    height = height_;
+    ensure((width % 2) == 0 && (height % 2) == 0);
+
+    ensure(open_device(node, fps, config, import_stride));
+    // the caller's buffers put the chroma plane right after height rows of luma
+    const auto importable = import_stride > 0 &&
+                            ystride == import_stride &&
+                            coded_h == height &&
+                            size_t(sizeimage) <= import_length;
+    if(importable) {
+        ensure(request_output(V4L2_MEMORY_DMABUF));
+        out_length = import_length;
+        return start_streaming();
+    }
+    if(import_stride > 0) {
+        WARN("encoder wants stride {} and {} rows, copying frames", ystride, coded_h);
+    }
+
+    ensure(request_output(V4L2_MEMORY_MMAP));
+    for(auto i = 0; i < out_count; i += 1) {
         auto pl     = v4l2_plane();
         auto qb     = v4l2_buffer();
-        qb.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        qb.type     = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
         qb.memory   = V4L2_MEMORY_MMAP;
         qb.index    = i;
         qb.length   = 1;
         qb.m.planes = &pl;
-        ensure(xioctl(vfd, VIDIOC_QUERYBUF, &qb) == 0, "QUERYBUF cap");
-        cap_len[i] = pl.length;
-        cap_ptr[i] = mmap(nullptr, pl.length, PROT_READ | PROT_WRITE, MAP_SHARED, vfd, pl.m.mem_offset);
-        ensure(cap_ptr[i] != MAP_FAILED, "mmap cap");
-        ensure(xioctl(vfd, VIDIOC_QBUF, &qb) == 0, "QBUF cap init");
+        ensure(xioctl(vfd, VIDIOC_QUERYBUF, &qb) == 0, "QUERYBUF out");
+        auto& buf   = out_bufs[i];
+        buf.map_len = pl.length;
+        buf.map     = mmap(nullptr, pl.length, PROT_READ | PROT_WRITE, MAP_SHARED, vfd, pl.m.mem_offset);
+        ensure(buf.map != MAP_FAILED, "mmap out");
     }
-
-    auto t = int(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-    ensure(xioctl(vfd, VIDIOC_STREAMON, &t) == 0, "STREAMON out");
-    t = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    ensure(xioctl(vfd, VIDIOC_STREAMON, &t) == 0, "STREAMON cap");
-    return true;
+    return start_streaming();
 }
 
-auto V4L2H264Encoder::encode(const GLuint src_rgba, const int64_t pts_us, const PacketCallback& on_packet) -> bool {
-    const auto pick_free = [&]() {
-        for(auto i = 0; i < num_out; i += 1) {
-            if(out_bufs[i].state == OutBuf::State::Free) {
-                return i;
-            }
-        }
-        return -1;
-    };
+auto V4L2Encoder::can_import() const -> bool {
+    return out_memory == V4L2_MEMORY_DMABUF;
+}
 
-    auto idx = -1;
-    for(;;) {
-        reclaim_output();
-        flush_pending(false); // QBUF anything the GPU has finished
-        idx = pick_free();
-        if(idx >= 0) {
-            break;
-        }
-        // no free buffer: wait for the encoder to consume a queued one,
-        // or (if everything is still mid-render) block on the oldest fence to free it up.
-        auto any_queued = false;
-        for(const auto& buf : out_bufs) {
-            any_queued |= buf.state == OutBuf::State::Queued;
-        }
-        if(any_queued) {
-            auto pfd = pollfd{.fd = vfd, .events = POLLOUT, .revents = 0};
-            poll(&pfd, 1, 200);
-        } else {
-            flush_pending(true);
-        }
+auto V4L2Encoder::encode(const std::byte* const y, const int y_stride, const std::byte* const uv, const int uv_stride, const int64_t pts_us, const PacketCallback& on_packet) -> bool {
+    ensure(out_memory == V4L2_MEMORY_MMAP);
+    if(drained) {
+        return true;
     }
+    deliver_packets(on_packet);
 
-    auto& buf  = out_bufs[idx];
+    const auto idx = pick_free();
+    if(idx < 0) {
+        return true;
+    }
+    auto&      buf = out_bufs[idx];
+    const auto dst = static_cast<std::byte*>(buf.map);
+    for(auto row = 0; row < height; row += 1) {
+        memcpy(dst + row * ystride, y + row * y_stride, width);
+    }
+    for(auto row = 0; row < height / 2; row += 1) {
+        memcpy(dst + uv_off + row * ystride, uv + row * uv_stride, width);
+    }
     buf.pts_us = pts_us;
-    render_into(buf, src_rgba); // sets buf.fence when fences are available
-    if(buf.fence != nullptr) {
-        buf.state = OutBuf::State::Pending;
-        pending.push_back(idx);
-    } else {
-        qbuf_output(idx); // glFinish fallback: writes already landed
+    return submit(idx);
+}
+
+auto V4L2Encoder::encode_dmabuf(const int index, const int fd, const int64_t pts_us, const PacketCallback& on_packet) -> bool {
+    ensure(can_import() && index >= 0 && index < out_count);
+    if(drained) {
+        return true;
     }
+    deliver_packets(on_packet);
 
-    drain_capture(on_packet);
-    return true;
+    auto& buf = out_bufs[index];
+    if(buf.state != OutBuf::State::Free) {
+        dropped_frames += 1;
+        return true;
+    }
+    buf.fd     = fd;
+    buf.pts_us = pts_us;
+    return submit(index);
 }
 
-auto V4L2H264Encoder::drain(const PacketCallback& on_packet) -> bool {
-    flush_pending(true); // QBUF every rendered-but-pending frame before stopping
+auto V4L2Encoder::wait_released(const int index) -> void {
+    auto& state = out_bufs[index].state;
+    for(auto s = state.load(); s != OutBuf::State::Free; s = state.load()) {
+        state.wait(s);
+    }
+}
 
-    auto ec = v4l2_encoder_cmd();
-    ec.cmd  = V4L2_ENC_CMD_STOP;
-    ioctl(vfd, VIDIOC_ENCODER_CMD, &ec);
+auto V4L2Encoder::drain(const PacketCallback& on_packet) -> bool {
+    // the service thread queues every pending frame, then stops the stream
+    drained = true;
+    if(service_thread.joinable()) {
+        stopping = true;
+        wake_service();
+        service_thread.join();
+    }
+    // hand the remaining output buffers back, imported dmabufs may be reused by the caller now
+    auto t = int(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    xioctl(vfd, VIDIOC_STREAMOFF, &t);
+    for(auto& buf : out_bufs) {
+        buf.state = OutBuf::State::Free;
+        buf.state.notify_all();
+    }
+    deliver_packets(on_packet);
+    for(auto& packet : backlog) {
+        deliver(packet, on_packet);
+    }
+    backlog.clear();
 
-    for(auto i = 0; i < 64; i += 1) {
-        auto pfd = pollfd{.fd = vfd, .events = POLLIN, .revents = 0};
-        if(poll(&pfd, 1, 200) <= 0) {
-            break;
-        }
-        drain_capture(on_packet);
+    if(dropped_frames > 0) {
+        WARN("{} frames dropped while the encoder was busy", dropped_frames);
     }
     return true;
 }
 
-auto V4L2H264Encoder::coded_width() const -> int {
+auto V4L2Encoder::set_control(const uint32_t id, const int32_t value) -> bool {
+    auto query = v4l2_queryctrl();
+    query.id   = id;
+    if(xioctl(vfd, VIDIOC_QUERYCTRL, &query) != 0 || (query.flags & V4L2_CTRL_FLAG_DISABLED)) {
+        WARN("encoder control {:#x} not supported", id);
+        return false;
+    }
+    const auto name = (const char*)query.name;
+    if(query.type != V4L2_CTRL_TYPE_BUTTON && (value < query.minimum || value > query.maximum)) {
+        WARN("{} = {} out of range {}..{}", name, value, query.minimum, query.maximum);
+        return false;
+    }
+    auto ctrl  = v4l2_control();
+    ctrl.id    = id;
+    ctrl.value = value;
+    if(xioctl(vfd, VIDIOC_S_CTRL, &ctrl) != 0) {
+        WARN("failed to set {} = {}: {}", name, value, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+auto V4L2Encoder::force_keyframe() -> bool {
+    return set_control(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+}
+
+auto V4L2Encoder::coded_width() const -> int {
     return coded_w;
 }
 
-auto V4L2H264Encoder::coded_height() const -> int {
+auto V4L2Encoder::coded_height() const -> int {
     return coded_h;
 }
 
-V4L2H264Encoder::~V4L2H264Encoder() {
+V4L2Encoder::~V4L2Encoder() {
+    if(service_thread.joinable()) {
+        stopping = true;
+        wake_service();
+        service_thread.join();
+    }
+    // packets nobody picked up return their buffers
+    const auto discard = [](Packet&) {};
+    deliver_packets(discard);
+    for(auto& packet : backlog) {
+        deliver(packet, discard);
+    }
     if(vfd >= 0) {
         auto t = int(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
         xioctl(vfd, VIDIOC_STREAMOFF, &t);
@@ -454,21 +897,69 @@ V4L2H264Encoder::~V4L2H264Encoder() {
     }
     for(auto& buf : out_bufs) {
         if(buf.fence) p_eglDestroySyncKHR(egl_dpy, buf.fence);
+        if(buf.fence_fd >= 0) close(buf.fence_fd);
         if(buf.fbo_y) glDeleteFramebuffers(1, &buf.fbo_y);
         if(buf.fbo_uv) glDeleteFramebuffers(1, &buf.fbo_uv);
         if(buf.tex_y) glDeleteTextures(1, &buf.tex_y);
         if(buf.tex_uv) glDeleteTextures(1, &buf.tex_uv);
         if(buf.img_y) p_eglDestroyImageKHR(egl_dpy, buf.img_y);
         if(buf.img_uv) p_eglDestroyImageKHR(egl_dpy, buf.img_uv);
-        if(buf.fd >= 0) close(buf.fd);
+        if(buf.bo && buf.fd >= 0) close(buf.fd);
         if(buf.bo) gbm_bo_destroy(buf.bo);
+        if(buf.map && buf.map != MAP_FAILED) munmap(buf.map, buf.map_len);
     }
     if(pack_prog) glDeleteProgram(pack_prog);
-    for(auto i = 0uz; i < cap_ptr.size(); i += 1) {
-        if(cap_ptr[i] && cap_ptr[i] != MAP_FAILED) munmap(cap_ptr[i], cap_len[i]);
-    }
+    if(caps) caps->unref(); // unmapped once the muxer releases the lent buffers too
     if(vfd >= 0) close(vfd);
+    if(wake_fd >= 0) close(wake_fd);
     if(gbm) gbm_device_destroy(gbm);
     if(drm_fd >= 0) close(drm_fd);
 }
+
+auto find_v4l2_encoders(const V4L2Codec codec) -> std::vector<std::string> {
+    auto ret = std::vector<std::string>();
+    for(auto i = 0; i < 64; i += 1) {
+        auto       path = std::format("/dev/video{}", i);
+        const auto fd   = open(path.data(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if(fd < 0) {
+            continue;
+        }
+        auto       cap  = v4l2_capability();
+        const auto caps = xioctl(fd, VIDIOC_QUERYCAP, &cap) != 0           ? 0u
+                          : (cap.capabilities & V4L2_CAP_DEVICE_CAPS) != 0 ? cap.device_caps
+                                                                           : cap.capabilities;
+        const auto ok = (caps & V4L2_CAP_VIDEO_M2M_MPLANE) != 0 &&
+                        has_format(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_PIX_FMT_NV12) &&
+                        has_format(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, v4l2_codec_fourcc(codec));
+        close(fd);
+        if(ok) {
+            ret.push_back(std::move(path));
+        }
+    }
+    return ret;
+}
+
+auto select_v4l2_encoder(const int width, const int height, const V4L2EncoderConfig& config, const bool gpu_input) -> std::optional<std::string> {
+    auto nodes = find_v4l2_encoders(config.codec);
+    ensure(!nodes.empty(), "no {} encoder found", v4l2_codec_name(config.codec));
+    if(nodes.size() == 1) {
+        return nodes[0];
+    }
+
+    auto best       = std::optional<std::string>();
+    auto best_speed = 0.0;
+    for(auto& node : nodes) {
+        const auto speed = measure_encoder(node.data(), width, height, config, gpu_input);
+        if(!speed) {
+            WARN("encoder {} failed the benchmark", node);
+            continue;
+        }
+        std::println("encoder {}: {:.1f} fps", node, *speed);
+        if(*speed > best_speed) {
+            best       = std::move(node);
+            best_speed = *speed;
+        }
+    }
+    return best;
+}
 } // namespace ff
@@ -1,43 +1,102 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <deque>
 #include <functional>
+#include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <gbm.h>
 
 #include <GL/gl.h>
 
+#include "../spsc-queue.hpp"
+#include "config.hpp"
+
 namespace ff {
-class V4L2H264Encoder {
+// stateful memory-to-memory encoder, nv12 in, coded packets out
+// the frames are either rendered on the gpu (init) or handed over from the cpu side (init_cpu)
+class V4L2Encoder {
   public:
     struct Packet {
+        using Release = void (*)(void* opaque, uint8_t* data); // av_buffer_create() compatible
+
         const std::byte* data;
         size_t           size;
         int64_t          pts_us;
         bool             keyframe;
+        // set when data is lent from a capture buffer, which is requeued by release(opaque, data)
+        // the receiver may take it over with std::exchange() to keep data beyond the callback
+        // otherwise data is only valid during the callback
+        Release release = nullptr;
+        void*   opaque  = nullptr;
     };
-    using PacketCallback = std::function<void(const Packet&)>;
+    using PacketCallback = std::function<void(Packet&)>;
+    // draws the luma (R8) and chroma (GR88) planes of one frame into the given framebuffers
+    using RenderCallback = std::function<void(GLuint fbo_y, GLuint fbo_uv, int width, int height)>;
 
   private:
     struct OutBuf {
         // free -> pending (rendered, GPU fence outstanding) -> queued (in V4L2)
+        // the loader only moves free -> pending, everything else happens on the service thread
+        // cpu frames have no fence and go straight through pending
         enum class State {
             Free,
             Pending,
             Queued,
         };
 
-        gbm_bo* bo     = nullptr;
-        int     fd     = -1;
-        void*   img_y  = nullptr; // EGLImageKHR
-        void*   img_uv = nullptr;
-        GLuint  tex_y  = 0;
-        GLuint  tex_uv = 0;
-        GLuint  fbo_y  = 0;
-        GLuint  fbo_uv = 0;
-        State   state  = State::Free;
-        void*   fence  = nullptr; // EGLSyncKHR while pending (GPU render completion)
-        int64_t pts_us = 0;
+        gbm_bo* bo       = nullptr;
+        int     fd       = -1; // owned only when bo is set, imported dmabufs belong to the caller
+        void*   map      = nullptr; // mmap-ed output buffer in the cpu copy mode
+        size_t  map_len  = 0;
+        void*   img_y    = nullptr; // EGLImageKHR
+        void*   img_uv   = nullptr;
+        GLuint  tex_y    = 0;
+        GLuint  tex_uv   = 0;
+        GLuint  fbo_y    = 0;
+        GLuint  fbo_uv   = 0;
+        void*   fence    = nullptr; // EGLSyncKHR while pending (GPU render completion)
+        int     fence_fd = -1;      // sync_file while pending, replaces fence when native fences are available
+        int64_t pts_us   = 0;
+
+        std::atomic<State> state = State::Free;
+    };
+
+    static constexpr int num_out = 6;
+    static constexpr int num_cap = 8;
+
+    // refcounted, packets lent from the buffers may outlive the encoder inside the muxer
+    struct CaptureBuffers {
+        struct Buffer {
+            CaptureBuffers* owner;
+            void*           ptr = nullptr;
+            size_t          len = 0;
+            uint32_t        index;
+        };
+
+        int                         vfd = -1; // dup of the encoder's fd, for requeueing
+        std::array<Buffer, num_cap> buffers;
+        uint32_t                    count  = 0;
+        std::atomic<int>            queued = 0; // in the driver
+        std::atomic<int>            refs   = 1; // the encoder and every lent buffer
+
+        static auto release(void* opaque, uint8_t* data) -> void;
+        auto        unref() -> void;
+
+        ~CaptureBuffers();
+    };
+
+    // coded data of a capture buffer, either lent or copied out so that the buffer can be requeued right away
+    struct CodedPacket {
+        std::vector<std::byte> copy;
+        int                    lent = -1; // capture buffer index
+        size_t                 size;
+        int64_t                pts_us;
+        bool                   keyframe;
     };
 
     int         vfd     = -1;
@@ -53,13 +112,29 @@ class V4L2H264Encoder {
     int sizeimage = 0;
     int uv_off    = 0;
 
-    static constexpr int num_out = 6;
-    static constexpr int num_cap = 4;
-    std::vector<OutBuf>  out_bufs;
-    std::vector<int>     pending; // rendered buffers awaiting fence->QBUF, in order
-    bool                 have_fence = false;
-    std::vector<void*>   cap_ptr;
-    std::vector<size_t>  cap_len;
+    std::array<OutBuf, num_out> out_bufs;
+    int                         out_count  = num_out; // as granted by REQBUFS
+    uint32_t                    out_memory = 0;       // V4L2_MEMORY_DMABUF or V4L2_MEMORY_MMAP
+    size_t                      out_length = 0;       // plane length of dmabuf output buffers
+    bool                        have_fence            = false;
+    bool                        have_native_fence     = false;
+    bool                        have_import_sync_file = true; // cleared on the first failure
+    CaptureBuffers*             caps = nullptr;
+    size_t                      dropped_frames = 0;
+    bool                        drained        = false; // frames arriving after drain() are ignored
+
+    // loader -> service thread
+    SPSCQueue<int, 8> submissions; // rendered buffers, in order
+    std::atomic<bool> stopping = false;
+    int               wake_fd  = -1; // eventfd
+
+    // service thread -> loader
+    SPSCQueue<CodedPacket, 64> packets;
+
+    // owned by the service thread
+    std::deque<int>         pending; // rendered buffers awaiting fence->QBUF, in order
+    std::deque<CodedPacket> backlog; // packets that did not fit into the queue
+    std::thread             service_thread;
 
     GLuint pack_prog   = 0;
     GLint  loc_src     = -1;
@@ -67,19 +142,67 @@ class V4L2H264Encoder {
     GLint  loc_dstsize = -1;
     GLint  loc_plane   = -1;
 
+    auto apply_config(const V4L2EncoderConfig& config, int fps) -> void;
+    // formats, controls and the eventfd, stride_hint is passed to the driver as the nv12 bytesperline
+    auto open_device(const char* node, int fps, const V4L2EncoderConfig& config, int stride_hint) -> bool;
+    auto request_output(uint32_t memory) -> bool;
+    // capture buffers, streamon and the service thread
+    auto start_streaming() -> bool;
+
+    // loader
+    auto pack_rgba(GLuint src_rgba, GLuint fbo_y, GLuint fbo_uv) -> void;
+    auto render_into(OutBuf& b, const RenderCallback& render) -> void;
+    auto pick_free() -> int;
+    auto submit(int idx) -> bool;
+    auto wake_service() -> void;
+    auto deliver(CodedPacket& packet, const PacketCallback& on_packet) -> void;
+    auto deliver_packets(const PacketCallback& on_packet) -> void;
+
+    // service thread
     auto reclaim_output() -> void;
-    auto drain_capture(const PacketCallback& on_packet) -> void;
-    auto render_into(OutBuf& b, GLuint src_rgba) -> void;
+    auto drain_capture() -> bool;
     auto qbuf_output(int idx) -> bool;
     auto flush_pending(bool block) -> void;
+    auto stop_stream() -> void;
+    auto service_main() -> void;
 
   public:
-    auto init(const char* venus_node, int width, int height, int bitrate, int fps) -> bool;
+    static constexpr int max_imports = num_out;
+
+    auto init(const char* node, int width, int height, int fps, const V4L2EncoderConfig& config) -> bool;
+    // renders into a free buffer and hands it to the service thread, never waits for the encoder
+    // the frame is dropped when every buffer is in use
+    // on_packet receives the packets finished since the last call
+    auto encode(const RenderCallback& render, int64_t pts_us, const PacketCallback& on_packet) -> bool;
     auto encode(GLuint src_rgba, int64_t pts_us, const PacketCallback& on_packet) -> bool;
+
+    // the caller's dmabufs are imported when they match the encoder's nv12 layout
+    // (import_stride and import_length describe them), otherwise frames are copied into mmap-ed buffers
+    auto init_cpu(const char* node, int width, int height, int fps, const V4L2EncoderConfig& config, int import_stride = 0, size_t import_length = 0) -> bool;
+    auto can_import() const -> bool;
+    // copy mode
+    auto encode(const std::byte* y, int y_stride, const std::byte* uv, int uv_stride, int64_t pts_us, const PacketCallback& on_packet) -> bool;
+    // import mode, index identifies the dmabuf and must be below max_imports
+    // the dmabuf must not be written again until wait_released(index) returns
+    auto encode_dmabuf(int index, int fd, int64_t pts_us, const PacketCallback& on_packet) -> bool;
+    auto wait_released(int index) -> void;
+
+    // returns every output buffer, later encode() calls are no-ops
+    // the caller serializes it with encode(), a loader may still hold the encoder when recording stops
     auto drain(const PacketCallback& on_packet) -> bool;
+    // checked against the control's range, warns and returns false when unsupported
+    auto set_control(uint32_t id, int32_t value) -> bool;
+    // the next submitted frame becomes an idr
+    auto force_keyframe() -> bool;
     auto coded_width() const -> int;
     auto coded_height() const -> int;
 
-    ~V4L2H264Encoder();
+    ~V4L2Encoder();
 };
+
+// m2m devices that encode nv12 into codec
+auto find_v4l2_encoders(V4L2Codec codec) -> std::vector<std::string>;
+// the fastest of find_v4l2_encoders(), measured by encoding a short clip when there is a choice
+// the clip is fed the way the caller will feed frames, gpu_input needs a current egl context
+auto select_v4l2_encoder(int width, int height, const V4L2EncoderConfig& config, bool gpu_input) -> std::optional<std::string>;
 } // namespace ff
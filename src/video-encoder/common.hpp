@@ -2,6 +2,7 @@
 #include <memory>
 
 extern "C" {
+#include <libavcodec/packet.h>
 #include <libavutil/frame.h>
 }
 
@@ -15,4 +16,5 @@ namespace ff {
     using Auto##Name = std::unique_ptr<Type, Name##Deleter>;
 
 av_declare_autoptr(AVFrame, AVFrame, av_frame_free);
+av_declare_autoptr(AVPacket, AVPacket, av_packet_free);
 }
@@ -2,6 +2,13 @@
 #include "../macros/assert.hpp"
 
 namespace ff {
+namespace {
+auto alloc_plane(void* const opaque, const size_t size) -> AVBufferRef* {
+    static_cast<PoolStats*>(opaque)->allocated += 1;
+    return av_buffer_alloc(size);
+}
+} // namespace
+
 auto AudioConverter::init(Format from_, Format to_) -> bool {
     from = from_;
     to   = to_;
@@ -23,21 +30,43 @@ auto AudioConverter::init(Format from_, Format to_) -> bool {
     return true;
 }
 
-auto AudioConverter::convert(const std::byte* const buffer, const size_t buffer_samples) -> std::optional<AutoAVFrame> {
-    auto inputf         = AutoAVFrame(av_frame_alloc());
+auto AudioConverter::convert(const std::byte* const buffer, const size_t buffer_samples) -> std::optional<PooledFrame> {
+    auto inputf = frame_pool().acquire();
+    ensure(inputf);
     inputf->data[0]     = (uint8_t*)buffer;
     inputf->sample_rate = from.rate;
     inputf->format      = from.format;
     inputf->ch_layout   = from_channel;
     inputf->nb_samples  = buffer_samples;
 
-    auto outputf         = AutoAVFrame(av_frame_alloc());
+    auto outputf = frame_pool().acquire();
+    ensure(outputf);
     outputf->sample_rate = to.rate;
     outputf->format      = to.format;
     outputf->ch_layout   = to_channel;
     outputf->nb_samples  = buffer_samples;
     outputf->pts         = size_t(1000000) * processed_samples / to.rate;
 
+    // take the planes from the pool, swr_convert_frame() would allocate them every time
+    auto       linesize = 0;
+    const auto size     = av_samples_get_buffer_size(&linesize, to_channel.nb_channels, buffer_samples, to.format, 0);
+    ensure(size > 0);
+    if(linesize != plane_size) {
+        plane_pool.reset(av_buffer_pool_init2(linesize, &plane_stats, alloc_plane, NULL));
+        ensure(plane_pool);
+        plane_size = linesize;
+    }
+    const auto planes = av_sample_fmt_is_planar(to.format) ? to_channel.nb_channels : 1;
+    ensure(planes <= AV_NUM_DATA_POINTERS);
+    for(auto i = 0; i < planes; i += 1) {
+        plane_stats.acquired += 1;
+        outputf->buf[i] = av_buffer_pool_get(plane_pool.get());
+        ensure(outputf->buf[i] != NULL);
+        outputf->data[i] = outputf->buf[i]->data;
+    }
+    outputf->extended_data = outputf->data;
+    outputf->linesize[0]   = linesize;
+
     processed_samples += buffer_samples;
 
     ensure(swr_convert_frame(swr_ctx.get(), outputf.get(), inputf.get()) == 0);
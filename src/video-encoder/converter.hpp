@@ -6,10 +6,11 @@ extern "C" {
 #include <libswresample/swresample.h>
 }
 
-#include "common.hpp"
+#include "pool.hpp"
 
 namespace ff {
 av_declare_autoptr(SwrContext, SwrContext, swr_free);
+av_declare_autoptr(AVBufferPool, AVBufferPool, av_buffer_pool_uninit);
 
 struct Format {
     int            rate;
@@ -26,8 +27,14 @@ class AudioConverter {
     AutoSwrContext  swr_ctx;
     size_t          processed_samples = 0;
 
+    // output planes, sized for the last buffer_samples
+    AutoAVBufferPool plane_pool;
+    int              plane_size = 0;
+
   public:
+    PoolStats plane_stats;
+
     auto init(Format from, Format to) -> bool;
-    auto convert(const std::byte* buffer, size_t buffer_samples) -> std::optional<AutoAVFrame>;
+    auto convert(const std::byte* buffer, size_t buffer_samples) -> std::optional<PooledFrame>;
 };
 } // namespace ff
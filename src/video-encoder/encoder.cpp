@@ -1,8 +1,18 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 extern "C" {
 #include <libavdevice/avdevice.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/dict.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/log.h>
 #include <libavutil/pixdesc.h>
 }
@@ -16,11 +26,97 @@ declare_autoptr(AVBufferSrcParameters, AVBufferSrcParameters, av_free);
 declare_autoptr(AVString, char, av_free);
 av_declare_autoptr(AVDict, AVDictionary, av_dict_free);
 av_declare_autoptr(AVFilterInOut, AVFilterInOut, avfilter_inout_free);
-av_declare_autoptr(AVPacket, AVPacket, av_packet_free);
 
 constexpr auto us_rational = AVRational{1, 1000000};
 
-auto derive_h264_extradata(const std::span<const uint8_t> annexb) -> std::vector<uint8_t> {
+// few large writes instead of many 32k ones, av_malloc() aligns it for simd
+constexpr auto io_buffer_size = 4 * 1024 * 1024;
+// a stream without packets holds the others back for at most this long
+constexpr auto max_interleave_delay_us = 1000000;
+
+// the buffer became const in ffmpeg 7
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+using WriteBuffer = const uint8_t*;
+#else
+using WriteBuffer = uint8_t*;
+#endif
+
+auto write_output(void* const opaque, const WriteBuffer buf, const int size) -> int {
+    const auto fd = *static_cast<const int*>(opaque);
+    for(auto done = 0; done < size;) {
+        const auto r = write(fd, buf + done, size - done);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        done += r;
+    }
+    return size;
+}
+
+auto seek_output(void* const opaque, const int64_t offset, const int whence) -> int64_t {
+    const auto fd = *static_cast<const int*>(opaque);
+    if(whence == AVSEEK_SIZE) {
+        struct stat st;
+        return fstat(fd, &st) == 0 ? st.st_size : AVERROR(errno);
+    }
+    const auto r = lseek(fd, offset, whence & ~AVSEEK_FORCE);
+    return r < 0 ? AVERROR(errno) : r;
+}
+
+// fd has to outlive ctx.pb
+auto open_output(AVFormatContext& ctx, const std::string& path, int& fd) -> bool {
+    fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ensure(fd >= 0, "failed to open {}: {}", path, strerror(errno));
+    const auto buffer = static_cast<uint8_t*>(av_malloc(io_buffer_size));
+    ensure(buffer != NULL);
+    ctx.pb = avio_alloc_context(buffer, io_buffer_size, 1, &fd, NULL, write_output, seek_output);
+    if(ctx.pb == NULL) {
+        av_free(buffer);
+        bail("avio_alloc_context failed");
+    }
+    ctx.flags |= AVFMT_FLAG_CUSTOM_IO;
+    return true;
+}
+
+auto close_output(AVFormatContext& ctx, const int fd) -> void {
+    if(ctx.pb != NULL) {
+        avio_flush(ctx.pb);
+        av_freep(&ctx.pb->buffer);
+        avio_context_free(&ctx.pb);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+auto packet_dts(const AVPacket& packet) -> int64_t {
+    return packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+}
+
+// name.mkv -> name-0001.mkv
+auto segment_path(const std::string_view output, const int number) -> std::string {
+    const auto slash = output.rfind('/');
+    const auto dot   = output.rfind('.');
+    const auto stem  = dot == output.npos || (slash != output.npos && dot < slash) ? output.size() : dot;
+    return std::format("{}-{:04}{}", output.substr(0, stem), number, output.substr(stem));
+}
+
+// the first software encoder of the codec
+auto find_software_encoder(const AVCodecID id) -> const AVCodec* {
+    auto opaque = (void*)(nullptr);
+    while(const auto codec = av_codec_iterate(&opaque)) {
+        if(av_codec_is_encoder(codec) && codec->id == id && !(codec->capabilities & AV_CODEC_CAP_HARDWARE)) {
+            return codec;
+        }
+    }
+    return nullptr;
+}
+
+// parameter sets of an annex-b h264/hevc stream
+auto derive_extradata(const AVCodecID codec_id, const std::span<const uint8_t> annexb) -> std::vector<uint8_t> {
     auto       ret = std::vector<uint8_t>();
     const auto u   = annexb.data();
     const auto n   = annexb.size();
@@ -43,8 +139,9 @@ auto derive_h264_extradata(const std::span<const uint8_t> annexb) -> std::vector
             }
         }
         const auto nal_end = (j + 3 < n) ? j : n;
-        const auto type    = u[nal_start] & 0x1f;
-        if(type == 7 || type == 8) { // SPS / PPS -> keep (with 4-byte start code)
+        const auto hevc    = codec_id == AV_CODEC_ID_HEVC;
+        const auto type    = hevc ? (u[nal_start] >> 1) & 0x3f : u[nal_start] & 0x1f;
+        if(hevc ? type >= 32 && type <= 34 : type == 7 || type == 8) { // VPS / SPS / PPS -> keep (with 4-byte start code)
             const uint8_t sc4[] = {0, 0, 0, 1};
             ret.insert(ret.end(), sc4, sc4 + 4);
             ret.insert(ret.end(), u + nal_start, u + nal_end);
@@ -55,7 +152,7 @@ auto derive_h264_extradata(const std::span<const uint8_t> annexb) -> std::vector
 }
 } // namespace
 
-auto Encoder::create_video_filter(const VideoParamsInternal& params, InternalVideoContext::HWBuffers& hw_bufs, AVCodecContext& codec_context) -> std::optional<VideoFilter> {
+auto Encoder::create_video_filter(const VideoParamsInternal& params, AVCodecContext& codec_context) -> std::optional<VideoFilter> {
     // build filter description
     auto filter_desc = std::string();
 
@@ -69,8 +166,9 @@ auto Encoder::create_video_filter(const VideoParamsInternal& params, InternalVid
         filter_desc += params.filter;
     }
     if(use_vaapi) {
+        // uploaded by push_frame() into the surface pool
         filter_desc += ",";
-        filter_desc += "hwupload@hwupload";
+        filter_desc += "format=nv12";
     }
     filter_desc += ",";
     filter_desc += "buffersink@sink";
@@ -87,11 +185,6 @@ auto Encoder::create_video_filter(const VideoParamsInternal& params, InternalVid
     filter.source_context = avfilter_graph_get_filter(filter.graph.get(), "buffer@source");
     filter.sink_context   = avfilter_graph_get_filter(filter.graph.get(), "buffersink@sink");
 
-    if(use_vaapi) {
-        const auto hwupload     = avfilter_graph_get_filter(filter.graph.get(), "hwupload@hwupload");
-        hwupload->hw_device_ctx = av_buffer_ref(hw_bufs.device.get());
-    }
-
     ensure(avfilter_graph_config(filter.graph.get(), NULL) >= 0);
 
     // copy pipline output's format to encoder input
@@ -129,6 +222,19 @@ auto Encoder::setup_crop_bsf(const VideoParamsExternal& params, const char* cons
     return ret;
 }
 
+auto Encoder::setup_dht_bsf(AVStream& stream) -> std::optional<AutoAVBSFContext> {
+    auto ret = AutoAVBSFContext();
+
+    // prepends the tables from the avi mjpeg spec to every frame
+    unwrap(bsf, av_bsf_get_by_name("mjpeg2jpeg"));
+    ensure(av_bsf_alloc(&bsf, std::inout_ptr(ret)) >= 0);
+    ensure(avcodec_parameters_copy(ret->par_in, stream.codecpar) >= 0);
+    ret->time_base_in = us_rational;
+    ensure(av_bsf_init(ret.get()) >= 0);
+
+    return ret;
+}
+
 auto Encoder::init_video_stream_internal(const VideoParamsInternal& params) -> std::optional<InternalVideoContext> {
     use_vaapi = params.codec.name.find("vaapi") != std::string::npos;
 
@@ -137,54 +243,80 @@ auto Encoder::init_video_stream_internal(const VideoParamsInternal& params) -> s
         av_dict_set(std::inout_ptr(options), opt[0].data(), opt[1].data(), 0);
     }
 
-    unwrap(codec, avcodec_find_encoder_by_name(params.codec.name.data()));
+    unwrap(requested_codec, avcodec_find_encoder_by_name(params.codec.name.data()));
+    auto codec   = &requested_codec;
+    auto hw_bufs = InternalVideoContext::HWBuffers();
+    if(use_vaapi) {
+        auto       device_context = (AVBufferRef*)(nullptr);
+        const auto render_node    = params.render_node.empty() ? NULL : params.render_node.data();
+        if(av_hwdevice_ctx_create(&device_context, AV_HWDEVICE_TYPE_VAAPI, render_node, NULL, 0) == 0) {
+            hw_bufs.device.reset(device_context);
+        } else {
+            // no gpu, encode the same format in software
+            codec = find_software_encoder(requested_codec.id);
+            ensure(codec != nullptr, "no vaapi device and no software encoder for {}", requested_codec.name);
+            WARN("no vaapi device, falling back to {}", codec->name);
+            use_vaapi = false;
+        }
+    }
+
     unwrap_mut(stream, avformat_new_stream(format_context.get(), NULL));
-    unwrap_mut(codec_context, avcodec_alloc_context3(&codec));
+    unwrap_mut(codec_context, avcodec_alloc_context3(codec));
     codec_context.width        = params.width;
     codec_context.height       = params.height;
     codec_context.time_base    = us_rational;
     codec_context.color_range  = AVCOL_RANGE_JPEG;
     codec_context.max_b_frames = params.b_frames;
     codec_context.thread_count = params.threads;
-
-    auto hw_bufs = InternalVideoContext::HWBuffers();
-    if(use_vaapi) {
-        auto       device_context = (AVBufferRef*)(nullptr);
-        const auto render_node    = params.render_node.empty() ? NULL : params.render_node.data();
-        ensure(av_hwdevice_ctx_create(&device_context, AV_HWDEVICE_TYPE_VAAPI, render_node, NULL, 0) == 0);
-        hw_bufs.device.reset(device_context);
+    if(params.thread_type != 0) {
+        codec_context.thread_type = params.thread_type;
     }
 
-    unwrap_mut(filter, create_video_filter(params, hw_bufs, codec_context));
+    unwrap_mut(filter, create_video_filter(params, codec_context));
 
     if(this->params.ffmpeg_debug) {
         auto dump = AutoAVString(avfilter_graph_dump(filter.graph.get(), 0));
         std::println("{}", dump.get());
     }
     if(use_vaapi) {
-        codec_context.hw_frames_ctx = av_buffer_ref(av_buffersink_get_hw_frames_ctx(filter.sink_context));
+        hw_bufs.frame_context.reset(av_hwframe_ctx_alloc(hw_bufs.device.get()));
+        ensure(hw_bufs.frame_context);
+        auto& frames     = *std::bit_cast<AVHWFramesContext*>(hw_bufs.frame_context->data);
+        frames.format    = AV_PIX_FMT_VAAPI;
+        frames.sw_format = codec_context.pix_fmt;
+        frames.width     = codec_context.width;
+        frames.height    = codec_context.height;
+        // references and reordering of the codec, plus the frame being uploaded
+        frames.initial_pool_size = params.b_frames + 16;
+        ensure(av_hwframe_ctx_init(hw_bufs.frame_context.get()) >= 0);
+
+        codec_context.pix_fmt       = AV_PIX_FMT_VAAPI;
+        codec_context.hw_frames_ctx = av_buffer_ref(hw_bufs.frame_context.get());
+        ensure(codec_context.hw_frames_ctx != NULL);
+        hw_bufs.frame.reset(av_frame_alloc());
+        ensure(hw_bufs.frame);
     }
 
     if(format_context->oformat->flags & AVFMT_GLOBALHEADER) {
         codec_context.flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
-    ensure(avcodec_open2(&codec_context, &codec, std::inout_ptr(options)) >= 0);
-
-    if(use_vaapi) {
-        hw_bufs.frame_context = av_hwframe_ctx_alloc(hw_bufs.device.get());
-        ensure(hw_bufs.frame_context != NULL);
-
-        codec_context.hw_device_ctx = hw_bufs.frame_context;
-        hw_bufs.frame.reset(av_frame_alloc());
-        ensure(hw_bufs.frame.get() != NULL);
-    }
+    ensure(avcodec_open2(&codec_context, codec, std::inout_ptr(options)) >= 0);
 
     ensure(avcodec_parameters_from_context(stream.codecpar, &codec_context) >= 0);
+    auto packet = AutoAVPacket(av_packet_alloc());
+    ensure(packet);
+    auto input = AutoAVFrame(av_frame_alloc());
+    ensure(input);
+    auto filtered = AutoAVFrame(av_frame_alloc());
+    ensure(filtered);
     return InternalVideoContext{
         .stream        = &stream,
         .codec_context = &codec_context,
+        .packet        = std::move(packet),
         .filter        = std::move(filter),
+        .input         = std::move(input),
+        .filtered      = std::move(filtered),
         .hw_bufs       = std::move(hw_bufs),
     };
 }
@@ -194,18 +326,37 @@ auto Encoder::init_video_stream_external(const VideoParamsExternal& params) -> s
 
     auto& par      = *stream.codecpar;
     par.codec_type = AVMEDIA_TYPE_VIDEO;
-    par.codec_id   = AV_CODEC_ID_H264;
+    par.codec_id   = params.codec_id;
     par.width      = params.real_width;
     par.height     = params.real_height;
     par.format     = AV_PIX_FMT_YUV420P;
+    if(params.codec_id == AV_CODEC_ID_MJPEG) {
+        par.format      = AV_PIX_FMT_YUVJ422P;
+        par.color_range = AVCOL_RANGE_JPEG;
+    }
 
     stream.time_base = us_rational;
 
-    unwrap_mut(bsf, setup_crop_bsf(params, "h264_metadata", stream));
+    // vp8/vp9 have no cropping, the padding stays visible
+    const auto crop_bsf = params.codec_id == AV_CODEC_ID_H264   ? "h264_metadata"
+                          : params.codec_id == AV_CODEC_ID_HEVC ? "hevc_metadata"
+                                                                : nullptr;
+    auto       bsf      = AutoAVBSFContext();
+    if(crop_bsf != nullptr) {
+        unwrap_mut(crop, setup_crop_bsf(params, crop_bsf, stream));
+        bsf = std::move(crop);
+    } else if(params.codec_id == AV_CODEC_ID_MJPEG && params.mjpeg_dht) {
+        unwrap_mut(dht, setup_dht_bsf(stream));
+        bsf = std::move(dht);
+    }
+
+    auto packet = AutoAVPacket(av_packet_alloc());
+    ensure(packet);
 
     return ExternalVideoContext{
         .stream = &stream,
         .bsf    = std::move(bsf),
+        .packet = std::move(packet),
     };
 }
 
@@ -229,10 +380,13 @@ auto Encoder::init_audio_stream_internal(const AudioParamsInternal& params) -> s
 
     ensure(avcodec_open2(&codec_context, &codec, std::inout_ptr(options)) >= 0);
     ensure(avcodec_parameters_from_context(stream.codecpar, &codec_context) >= 0);
+    auto packet = AutoAVPacket(av_packet_alloc());
+    ensure(packet);
 
     return InternalAudioContext{
         .stream        = &stream,
         .codec_context = &codec_context,
+        .packet        = std::move(packet),
     };
 }
 
@@ -256,11 +410,174 @@ auto Encoder::init_codecs() -> bool {
     if(params.ffmpeg_debug) {
         av_dump_format(format_context.get(), 0, params.output.data(), 1);
     }
-    ensure(avio_open(&format_context->pb, params.output.data(), AVIO_FLAG_WRITE) >= 0);
+    if(uses_template()) {
+        // the template is never written, keep its timestamps in microseconds for write_packet()
+        for(auto i = 0u; i < format_context->nb_streams; i += 1) {
+            const auto stream = format_context->streams[i];
+            stream->time_base = us_rational;
+            if(stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                segment_cut_stream = stream->index;
+            }
+        }
+    } else if(!(output_format->flags & AVFMT_NOFILE)) {
+        ensure(open_output(*format_context, params.output, output_fd));
+    }
 
     return true;
 }
 
+auto Encoder::write_header(AVFormatContext& ctx) -> bool {
+    auto options = AutoAVDict();
+    if(params.fragmented) {
+        // each muxer picks up its own option
+        av_dict_set(std::inout_ptr(options), "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set(std::inout_ptr(options), "cluster_time_limit", "1000", 0);
+    }
+    ensure(avformat_write_header(&ctx, std::inout_ptr(options)) >= 0);
+    return true;
+}
+
+auto Encoder::is_segmented() const -> bool {
+    return params.segment.seconds > 0 || params.segment.bytes > 0;
+}
+
+auto Encoder::uses_template() const -> bool {
+    return is_segmented() || is_deferred();
+}
+
+auto Encoder::is_deferred() const -> bool {
+    return params.defer_output || params.preroll.seconds > 0;
+}
+
+auto Encoder::open_segment(const int64_t start_us) -> bool {
+    auto next      = std::make_unique<Segment>();
+    next->path     = is_segmented() ? segment_path(params.output, segment_number += 1) : params.output;
+    next->start_us = start_us;
+
+    auto ctx = (AVFormatContext*)(nullptr);
+    ensure(avformat_alloc_output_context2(&ctx, output_format, NULL, next->path.data()) >= 0);
+    next->context.reset(ctx);
+    for(auto i = 0u; i < format_context->nb_streams; i += 1) {
+        const auto src = format_context->streams[i];
+        unwrap_mut(stream, avformat_new_stream(ctx, NULL));
+        ensure(avcodec_parameters_copy(stream.codecpar, src->codecpar) >= 0);
+        stream.time_base = src->time_base;
+    }
+    if(!open_output(*ctx, next->path, next->fd) || !write_header(*ctx)) {
+        close_output(*ctx, next->fd);
+        return false;
+    }
+
+    // the trailer of the previous one may seek back through the whole file, do it aside
+    if(segment) {
+        if(finalizer.joinable()) {
+            finalizer.join();
+        }
+        finalizer = std::thread([prev = std::move(segment)]() {
+            av_write_trailer(prev->context.get());
+            close_output(*prev->context, prev->fd);
+        });
+    }
+    segment     = std::move(next);
+    cut_overdue = false;
+
+    segment_history.push_back({segment->path, start_us});
+    if(params.segment.keep_secs > 0) {
+        // drop the segments that ended before the retention window
+        const auto keep_us = int64_t(params.segment.keep_secs) * 1000000;
+        while(segment_history.size() > 1 && segment_history[1].start_us <= start_us - keep_us) {
+            unlink(segment_history.front().path.data());
+            segment_history.pop_front();
+        }
+    }
+    return true;
+}
+
+auto Encoder::is_cut_point(const AVPacket& packet) const -> bool {
+    return segment_cut_stream < 0 || (packet.stream_index == segment_cut_stream && (packet.flags & AV_PKT_FLAG_KEY));
+}
+
+auto Encoder::write_packet(AVPacket* const packet) -> bool {
+    if(!uses_template()) {
+        return av_write_frame(format_context.get(), packet) >= 0;
+    }
+
+    // the template streams are in microseconds
+    const auto cut = is_cut_point(*packet);
+    if(!segment && !cut) {
+        // a decoder can only start at a keyframe, the audio before it goes too
+        return true;
+    }
+    const auto  dts    = packet_dts(*packet);
+    const auto& limits = params.segment;
+    const auto  due    = segment != nullptr &&
+                     ((limits.seconds > 0 && dts - segment->start_us >= int64_t(limits.seconds) * 1000000) ||
+                      (limits.bytes > 0 && avio_tell(segment->context->pb) >= limits.bytes));
+    if(!segment || (cut && due)) {
+        ensure(open_segment(dts));
+    } else if(due && !cut_overdue) {
+        // the gop may be much longer than the segment, ask once for an early keyframe
+        cut_overdue     = true;
+        keyframe_wanted = true;
+    }
+    // packets carry the time since init(), every file starts from 0, held or segmented alike
+    if(packet->pts != AV_NOPTS_VALUE) {
+        packet->pts -= segment->start_us;
+    }
+    if(packet->dts != AV_NOPTS_VALUE) {
+        packet->dts -= segment->start_us;
+    }
+    av_packet_rescale_ts(packet, us_rational, segment->context->streams[packet->stream_index]->time_base);
+    return av_write_frame(segment->context.get(), packet) >= 0;
+}
+
+auto Encoder::hold_preroll(PooledPacket packet) -> void {
+    // timestamps are in microseconds, as in write_packet()
+    const auto newest    = packet_dts(*packet);
+    const auto window_us = int64_t(params.preroll.seconds) * 1000000;
+    preroll_bytes += packet->size;
+    preroll.push_back(std::move(packet));
+
+    // only whole gops are dropped, so that the oldest packet held stays a keyframe to start from
+    // one goes once the rest still covers the window, or while over the memory bound
+    // a single gop above the bound is kept whole
+    while(true) {
+        const auto next = std::find_if(preroll.begin() + 1, preroll.end(), [this](const PooledPacket& p) { return is_cut_point(*p); });
+        if(next == preroll.end()) {
+            break;
+        }
+        const auto aged = newest - packet_dts(**next) >= window_us;
+        const auto full = params.preroll.bytes > 0 && preroll_bytes > params.preroll.bytes;
+        if(!aged && !full) {
+            break;
+        }
+        for(auto count = next - preroll.begin(); count > 0; count -= 1) {
+            preroll_bytes -= preroll.front()->size;
+            preroll.pop_front();
+        }
+    }
+}
+
+auto Encoder::flush_preroll() -> bool {
+    // write_packet() opens the file at the first keyframe and rebases the timestamps
+    auto held     = std::exchange(preroll, {});
+    preroll_bytes = 0;
+    for(auto& packet : held) {
+        ensure(write_packet(packet.get()), "failed to write packet");
+    }
+    return true;
+}
+
+auto Encoder::start_output(std::string path) -> bool {
+    ensure(is_deferred() && output_request.load() == OutputRequest::None, "output already started");
+    params.output = std::move(path); // read by the mux thread after the request
+    // the producers may be the ones that get the header written, never wait for the mux thread here
+    output_request.store(OutputRequest::Requested);
+    mux_wake.fetch_add(1);
+    mux_wake.notify_one();
+    return true;
+}
+
 auto Encoder::init(EncoderParams params_) -> bool {
     params = std::move(params_);
 
@@ -276,87 +593,186 @@ auto Encoder::init(EncoderParams params_) -> bool {
     ensure(avformat_alloc_output_context2(&fmt_ctx, NULL, NULL, params.output.data()) >= 0);
     format_context.reset(fmt_ctx);
 
+    output_started = !is_deferred();
     ensure(init_codecs());
+    ensure(mux_queue.init(256));
+    mux_thread = std::thread(&Encoder::mux_main, this);
 
     init_done = true;
     return true;
 }
 
-auto Encoder::encode(AVFrame* const frame, AVPacket* packet, bool video) -> bool {
+auto Encoder::encode(AVFrame* const frame, const bool video) -> bool {
     const auto stream = video ? vctx.as<InternalVideoContext>().stream : actx.as<InternalAudioContext>().stream;
     const auto ctx    = video ? vctx.as<InternalVideoContext>().codec_context : actx.as<InternalAudioContext>().codec_context;
-    {
-        const auto guard = std::lock_guard(video ? video_encode_lock : audio_encode_lock);
-        ensure(avcodec_send_frame(ctx, frame) >= 0);
+    const auto packet = video ? vctx.as<InternalVideoContext>().packet.get() : actx.as<InternalAudioContext>().packet.get();
+    auto&      delay  = video ? video_delay : audio_delay;
+
+    const auto guard = std::lock_guard(video ? video_encode_lock : audio_encode_lock);
+    if(const auto ret = avcodec_send_frame(ctx, frame); ret == AVERROR_EOF && frame == NULL) {
+        return true; // already flushed
+    } else {
+        ensure(ret >= 0);
+    }
+    if(frame != NULL) {
+        delay.held += 1;
+        delay.max_held = std::max(delay.max_held, delay.held);
+    }
+    // b-frames and frame threads return several packets for one frame, and everything at eof
+    while(true) {
         if(const auto ret = avcodec_receive_packet(ctx, packet); ret < 0) {
             return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
         }
-        av_packet_rescale_ts(packet, ctx->time_base, stream->time_base);
+        delay.held -= 1;
+        ensure(mux_packet(packet, stream, ctx->time_base));
     }
-    packet->stream_index = stream->index;
-    {
-        const auto format_guard = std::lock_guard(format_lock);
-        ensure(av_interleaved_write_frame(format_context.get(), packet) >= 0);
-    }
-    return true;
 }
 
-auto Encoder::push_frame(AutoAVFrame frame, const int usec) -> bool {
-    unwrap_mut(ctx, vctx.get<InternalVideoContext>());
+auto Encoder::push_frame(InternalVideoContext& ctx, const int usec) -> bool {
+    // the codec keeps its own references, drop ours from the previous call
+    const auto filtered = ctx.filtered.get();
+    const auto surface  = ctx.hw_bufs.frame.get();
+    av_frame_unref(filtered);
+    if(use_vaapi) {
+        av_frame_unref(surface);
+    }
 
-    frame->pts = usec;
+    ctx.input->pts = usec;
+    ensure(av_buffersrc_add_frame_flags(ctx.filter.source_context, ctx.input.get(), 0) >= 0);
+    ensure(av_buffersink_get_frame(ctx.filter.sink_context, filtered) >= 0);
+    filtered->pict_type = keyframe_wanted.exchange(false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    if(!use_vaapi) {
+        ensure(encode(filtered, true));
+        return true;
+    }
 
-    auto filtered = AutoAVFrame(av_frame_alloc());
-    ensure(filtered.get() != NULL);
-    {
-        auto filter_guard = std::lock_guard(filter_lock);
-        ensure(av_buffersrc_add_frame_flags(ctx.filter.source_context, frame.get(), 0) >= 0);
-        ensure(av_buffersink_get_frame(ctx.filter.sink_context, filtered.get()) >= 0);
-    }
-    filtered->pict_type = AV_PICTURE_TYPE_NONE;
-
-    auto pkt  = AutoAVPacket(av_packet_alloc());
-    pkt->data = NULL;
-    pkt->size = 0;
-    ensure(encode(filtered.get(), pkt.get(), true));
+    ensure(av_hwframe_get_buffer(ctx.hw_bufs.frame_context.get(), surface, 0) >= 0);
+    ensure(av_hwframe_transfer_data(surface, filtered, 0) >= 0);
+    ensure(av_frame_copy_props(surface, filtered) >= 0);
+    ensure(encode(surface, true));
     return true;
 }
 
 auto Encoder::add_frame(std::span<const Plane> planes, const int usec) -> bool {
+    if(write_failed) {
+        return false;
+    }
     ensure(ensure_header({}));
     ensure(planes.size() <= AV_NUM_DATA_POINTERS);
 
-    auto frame = AutoAVFrame(av_frame_alloc());
-    ensure(frame.get() != NULL);
-
     unwrap(params, this->params.video->get<VideoParamsInternal>());
+    unwrap_mut(ctx, vctx.get<InternalVideoContext>());
+
+    const auto filter_guard = std::lock_guard(filter_lock);
+    auto&      frame        = *ctx.input;
     for(auto i = 0u; i < planes.size(); i += 1) {
-        frame->data[i]     = std::bit_cast<uint8_t*>(planes[i].data);
-        frame->linesize[i] = planes[i].stride;
+        frame.data[i]     = std::bit_cast<uint8_t*>(planes[i].data);
+        frame.linesize[i] = planes[i].stride;
     }
-    frame->format = params.pix_fmt;
-    frame->width  = params.width;
-    frame->height = params.height;
+    frame.format = params.pix_fmt;
+    frame.width  = params.width;
+    frame.height = params.height;
 
-    return push_frame(std::move(frame), usec);
+    return push_frame(ctx, usec);
 }
 
 auto Encoder::mux_packet(AVPacket* const packet, AVStream* const stream, const AVRational src_tb) -> bool {
     av_packet_rescale_ts(packet, src_tb, stream->time_base);
-    packet->stream_index    = stream->index;
-    const auto format_guard = std::lock_guard(format_lock);
-    return av_interleaved_write_frame(format_context.get(), packet) >= 0;
+    packet->stream_index = stream->index;
+    while(!mux_queue.push(packet)) {
+        // the disk fell a whole queue behind, wait rather than drop
+        std::this_thread::yield();
+    }
+    mux_wake.fetch_add(1);
+    mux_wake.notify_one();
+    return true;
+}
+
+auto Encoder::mux_main() -> void {
+    const auto dts_us = [this](const AVPacket& packet) {
+        const auto dts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+        return av_rescale_q(dts, format_context->streams[packet.stream_index]->time_base, us_rational);
+    };
+
+    auto pending = std::vector<std::deque<PooledPacket>>(format_context->nb_streams); // per stream, in dts order
+    auto newest  = std::numeric_limits<int64_t>::min();                               // dts_us of the latest packet
+loop:
+    const auto wake     = mux_wake.load();
+    const auto stopping = mux_stopping.load(); // producers are done before this is set
+    // only take a packet from the pool for something to hold, the stats count real uses
+    while(!mux_queue.empty()) {
+        auto packet = packet_pool().acquire();
+        if(!packet || !mux_queue.pop(packet.get())) {
+            break;
+        }
+        newest = std::max(newest, dts_us(*packet));
+        pending[packet->stream_index].push_back(std::move(packet));
+    }
+
+    // interleave by dts, waiting for a stream only while it is not too far behind
+    // packets that beat the header are held until it is written, or dropped with pending
+    while(header_written) {
+        auto next     = (std::deque<PooledPacket>*)(nullptr);
+        auto complete = true;
+        for(auto& queue : pending) {
+            if(queue.empty()) {
+                complete = false;
+            } else if(next == nullptr || dts_us(*queue.front()) < dts_us(*next->front())) {
+                next = &queue;
+            }
+        }
+        if(next == nullptr || (!complete && !stopping && newest - dts_us(*next->front()) < max_interleave_delay_us)) {
+            break;
+        }
+        auto packet = std::move(next->front());
+        next->pop_front();
+        if(!output_started) {
+            hold_preroll(std::move(packet));
+        } else if(!write_failed && !write_packet(packet.get())) {
+            // a full disk or a removed card, the producers notice and stop the recording
+            WARN("failed to write packet, dropping the rest");
+            write_failed = true;
+        }
+    }
+
+    // the pre-roll only fills once the header is ready, an empty one leaves the file to the first packet
+    if(output_request.load() == OutputRequest::Requested) {
+        const auto ok = flush_preroll();
+        if(!ok) {
+            WARN("failed to start {}", params.output);
+            write_failed = true;
+        }
+        output_started.store(ok);
+        output_request.store(ok ? OutputRequest::Started : OutputRequest::Failed);
+    }
+
+    if(stopping) {
+        if(segment) {
+            av_write_trailer(segment->context.get());
+            close_output(*segment->context, segment->fd);
+            segment.reset();
+        }
+        return;
+    }
+    mux_wake.wait(wake);
+    goto loop;
 }
 
 auto Encoder::ensure_header(const std::span<const uint8_t> annexb) -> bool {
     if(header_written) {
         return true;
     }
+    // loaders may race for the first frame, nothing is muxed until this is done
+    const auto guard = std::lock_guard(header_lock);
+    if(header_written) {
+        return true;
+    }
 
-    if(const auto ctx = vctx.get<ExternalVideoContext>()) {
-        // externally encoded, need to feed SPS/PPS
-        const auto extradata = derive_h264_extradata(annexb);
-        ensure(!extradata.empty(), "no SPS/PPS in first H264 packet");
+    const auto ctx = vctx.get<ExternalVideoContext>();
+    if(const auto codec_id = ctx ? ctx->stream->codecpar->codec_id : AV_CODEC_ID_NONE; codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_HEVC) {
+        // externally encoded, need to feed the parameter sets
+        const auto extradata = derive_extradata(codec_id, annexb);
+        ensure(!extradata.empty(), "no parameter sets in the first packet");
 
         auto* const par = ctx->stream->codecpar;
         par->extradata  = static_cast<uint8_t*>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
@@ -365,39 +781,62 @@ auto Encoder::ensure_header(const std::span<const uint8_t> annexb) -> bool {
         par->extradata_size = int(extradata.size());
     }
 
-    auto dummy = AutoAVDict();
-    ensure(avformat_write_header(format_context.get(), std::inout_ptr(dummy)) >= 0);
+    if(!uses_template()) {
+        ensure(write_header(*format_context));
+    }
     header_written = true;
 
     return true;
 }
 
-auto Encoder::add_video_packet(const std::byte* const data, const size_t size, const int64_t pts_us, const bool keyframe) -> bool {
+auto Encoder::add_video_packet(const std::byte* const data, const size_t size, const int64_t pts_us, const bool keyframe, const BufferFree free, void* const opaque) -> bool {
+    // wrap the caller's buffer before anything can fail, so that free() is called exactly once
+    auto buf = AutoAVBufferRef();
+    if(free != nullptr) {
+        buf.reset(av_buffer_create((uint8_t*)data, size, free, opaque, AV_BUFFER_FLAG_READONLY));
+        if(buf == nullptr) {
+            free(opaque, (uint8_t*)data);
+            bail("av_buffer_create failed");
+        }
+    }
+    if(write_failed) {
+        return false;
+    }
     unwrap(ctx, vctx.get<ExternalVideoContext>());
-    auto pkt = AutoAVPacket(av_packet_alloc());
-    ensure(av_new_packet(pkt.get(), int(size)) == 0);
-    memcpy(pkt->data, data, size);
+
+    const auto guard = std::lock_guard(video_encode_lock);
+    const auto pkt   = ctx.packet.get();
+    av_packet_unref(pkt); // left over from a failed call
+    if(buf) {
+        pkt->buf  = buf.release();
+        pkt->data = pkt->buf->data;
+        pkt->size = int(size);
+    } else {
+        ensure(av_new_packet(pkt, int(size)) == 0);
+        memcpy(pkt->data, data, size);
+    }
     pkt->pts = pkt->dts = pts_us;
     if(keyframe) {
         pkt->flags |= AV_PKT_FLAG_KEY;
     }
 
-    const auto guard = std::lock_guard(video_encode_lock);
-    if(ctx.bsf != nullptr) {
-        ensure(av_bsf_send_packet(ctx.bsf.get(), pkt.get()) >= 0);
-        while(true) {
-            const auto r = av_bsf_receive_packet(ctx.bsf.get(), pkt.get());
-            if(r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
-                break;
-            }
-            ensure(r >= 0);
-            ensure(ensure_header(std::span<const uint8_t>{pkt->data, size_t(pkt->size)}));
-            ensure(mux_packet(pkt.get(), ctx.stream, us_rational));
-            av_packet_unref(pkt.get());
+    // only keyframes carry parameter sets, the rest skips the crop bsf which would rewrite the whole packet
+    // every mjpeg frame is a keyframe and gets its tables
+    if(ctx.bsf == nullptr || !keyframe) {
+        ensure(ensure_header({pkt->data, size}));
+        ensure(mux_packet(pkt, ctx.stream, us_rational));
+        return true;
+    }
+    ensure(av_bsf_send_packet(ctx.bsf.get(), pkt) >= 0);
+    while(true) {
+        const auto r = av_bsf_receive_packet(ctx.bsf.get(), pkt);
+        if(r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
+            break;
         }
-    } else {
-        ensure(ensure_header({(uint8_t*)data, size}));
-        ensure(mux_packet(pkt.get(), ctx.stream, us_rational));
+        ensure(r >= 0);
+        ensure(ensure_header(std::span<const uint8_t>{pkt->data, size_t(pkt->size)}));
+        ensure(mux_packet(pkt, ctx.stream, us_rational));
+        av_packet_unref(pkt);
     }
     return true;
 }
@@ -406,15 +845,23 @@ auto Encoder::is_header_written() const -> bool {
     return header_written;
 }
 
+auto Encoder::has_failed() const -> bool {
+    return write_failed;
+}
+
+auto Encoder::take_keyframe_request() -> bool {
+    return keyframe_wanted.exchange(false);
+}
+
 auto Encoder::get_audio_samples_per_push() const -> size_t {
     return actx.as<InternalAudioContext>().codec_context->frame_size;
 }
 
 auto Encoder::add_audio(AVFrame* frame) -> bool {
-    auto pkt  = AutoAVPacket(av_packet_alloc());
-    pkt->data = NULL;
-    pkt->size = 0;
-    return encode(frame, pkt.get(), false);
+    if(write_failed) {
+        return false;
+    }
+    return encode(frame, false);
 }
 
 auto Encoder::add_audio(const std::span<const std::byte* const> buffers) -> bool {
@@ -422,8 +869,8 @@ auto Encoder::add_audio(const std::span<const std::byte* const> buffers) -> bool
     unwrap(ctx, actx.get<InternalAudioContext>());
     ensure(buffers.size() == size_t(ctx.codec_context->ch_layout.nb_channels));
 
-    auto frame = AutoAVFrame(av_frame_alloc());
-    ensure(frame.get() != NULL);
+    auto frame = frame_pool().acquire();
+    ensure(frame);
 
     for(auto i = 0; i < ctx.codec_context->ch_layout.nb_channels; i += 1) {
         frame->data[i] = std::bit_cast<uint8_t*>(buffers[i]);
@@ -441,19 +888,33 @@ Encoder::~Encoder() {
         return;
     }
 
-    auto pkt = AutoAVPacket(av_packet_alloc());
     if(vctx.get_index() == VideoContext::index_of<InternalVideoContext>) {
-        encode(NULL, pkt.get(), true);
+        encode(NULL, true);
     }
     if(actx.get_index() == AudioContext::index_of<InternalAudioContext>) {
-        encode(NULL, pkt.get(), false);
+        encode(NULL, false);
+    }
+    if(params.ffmpeg_debug) {
+        std::println("codec delay: video {} frames (max {}), audio {} frames (max {})",
+                     video_delay.held, video_delay.max_held, audio_delay.held, audio_delay.max_held);
+        std::println("pools: {} frames for {} uses, {} packets for {} uses",
+                     frame_pool().stats.allocated.load(), frame_pool().stats.acquired.load(),
+                     packet_pool().stats.allocated.load(), packet_pool().stats.acquired.load());
     }
 
-    if(header_written) {
+    mux_stopping = true;
+    mux_wake.fetch_add(1);
+    mux_wake.notify_one();
+    mux_thread.join();
+    if(finalizer.joinable()) {
+        finalizer.join();
+    }
+
+    if(header_written && !uses_template()) {
         av_write_trailer(format_context.get());
     }
-    if(output_format && (!(output_format->flags & AVFMT_NOFILE))) {
-        avio_closep(&format_context->pb);
+    if(format_context->flags & AVFMT_FLAG_CUSTOM_IO) {
+        close_output(*format_context, output_fd);
     }
 }
 } // namespace ff
@@ -1,8 +1,12 @@
 #pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <span>
 #include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -17,6 +21,8 @@ extern "C" {
 #include "../macros/autoptr.hpp"
 #include "../util/variant.hpp"
 #include "common.hpp"
+#include "packet-queue.hpp"
+#include "pool.hpp"
 
 namespace ff {
 declare_autoptr(FormatContext, AVFormatContext, avformat_free_context);
@@ -29,6 +35,9 @@ struct Plane {
     int              stride;
 };
 
+// av_buffer_create() compatible
+using BufferFree = void (*)(void* opaque, uint8_t* data);
+
 struct Codec {
     std::string                             name;
     std::vector<std::array<std::string, 2>> options;
@@ -40,20 +49,23 @@ struct VideoParamsInternal {
     AVPixelFormat pix_fmt;
     int           width;
     int           height;
-    int           b_frames = 3;
-    int           threads  = 0;
-    std::string   filter   = "";
+    int           b_frames    = 3;
+    int           threads     = 0;
+    int           thread_type = 0; // FF_THREAD_*, 0 = codec default
+    std::string   filter      = "";
 
     // vaapi
     std::string render_node = ""; // something like /dev/dri/renderD128
 };
 
-// parameters when using external(e.g. venus) encoder
+// parameters when using external(e.g. venus) encoder, or the camera's own bitstream
 struct VideoParamsExternal {
-    int real_width;
-    int real_height;
-    int coded_width;
-    int coded_height;
+    AVCodecID codec_id = AV_CODEC_ID_H264; // h264, hevc, vp8, vp9 or mjpeg
+    int       real_width;
+    int       real_height;
+    int       coded_width;
+    int       coded_height;
+    bool      mjpeg_dht = false; // insert the default huffman tables which uvc cameras leave out
 };
 
 using VideoParams = Variant<VideoParamsInternal, VideoParamsExternal>;
@@ -67,13 +79,30 @@ struct AudioParamsInternal {
 
 using AudioParams = Variant<AudioParamsInternal>;
 
+// splits the output into name-0001.ext, name-0002.ext, ... at video keyframes
+struct SegmentParams {
+    int     seconds   = 0; // cut after this long, 0 = no limit
+    int64_t bytes     = 0; // or after this many bytes, 0 = no limit
+    int     keep_secs = 0; // delete the segments older than this, 0 = keep all
+};
+
+// keeps the packets of the last seconds in memory until Encoder::start_output()
+struct PrerollParams {
+    int     seconds = 0; // 0 = write from the start
+    int64_t bytes   = 0; // memory bound, 0 = no limit
+};
+
 struct EncoderParams {
     std::string output;
 
     std::optional<VideoParams> video;
     std::optional<AudioParams> audio;
 
-    bool ffmpeg_debug = false;
+    SegmentParams segment;              // segmented when seconds or bytes is set
+    PrerollParams preroll;              // output is only the format hint until start_output()
+    bool          defer_output = false; // same without the pre-roll, for a standby encoder
+    bool          fragmented   = false; // fragmented mp4 or short matroska clusters, a crash only loses the tail
+    bool          ffmpeg_debug = false;
 };
 
 class Encoder {
@@ -88,13 +117,16 @@ class Encoder {
     struct InternalVideoContext {
         AVStream*       stream;
         AVCodecContext* codec_context;
+        AutoAVPacket    packet; // reused, every mux leaves it blank
         VideoFilter     filter;
+        AutoAVFrame     input;    // reused under filter_lock
+        AutoAVFrame     filtered; // reused under filter_lock
 
         // vaapi only
         struct HWBuffers {
             AutoAVBufferRef device;
-            AVBufferRef*    frame_context;
-            AutoAVFrame     frame;
+            AutoAVBufferRef frame_context; // pre-sized pool of surfaces
+            AutoAVFrame     frame;         // reused under filter_lock, a surface from the pool
         };
 
         HWBuffers hw_bufs;
@@ -103,6 +135,7 @@ class Encoder {
     struct ExternalVideoContext {
         AVStream*        stream;
         AutoAVBSFContext bsf;
+        AutoAVPacket     packet; // reused, every mux leaves it blank
     };
 
     using VideoContext = Variant<InternalVideoContext, ExternalVideoContext>;
@@ -110,10 +143,29 @@ class Encoder {
     struct InternalAudioContext {
         AVStream*       stream;
         AVCodecContext* codec_context;
+        AutoAVPacket    packet; // reused, every mux leaves it blank
     };
 
     using AudioContext = Variant<InternalAudioContext>;
 
+    // frames sent to a codec whose packets have not come out yet, guarded by the encode lock
+    struct CodecDelay {
+        int held     = 0;
+        int max_held = 0;
+    };
+
+    struct Segment {
+        AutoFormatContext context;
+        int               fd = -1;
+        std::string       path;
+        int64_t           start_us;
+    };
+
+    struct SegmentHistory {
+        std::string path;
+        int64_t     start_us;
+    };
+
     EncoderParams         params;
     const AVOutputFormat* output_format;
     AutoFormatContext     format_context;
@@ -121,30 +173,85 @@ class Encoder {
     AudioContext          actx;
     bool                  init_done = false;
     bool                  use_vaapi;
-    bool                  header_written = false;
+    std::atomic<bool>     header_written = false;
+    std::atomic<bool>     write_failed   = false; // sticky, set by the mux thread
+    int                   output_fd      = -1;
 
-    std::mutex format_lock;
+    std::mutex header_lock;
     std::mutex video_encode_lock;
     std::mutex audio_encode_lock;
     std::mutex filter_lock;
+    CodecDelay video_delay;
+    CodecDelay audio_delay;
+
+    // the mux thread interleaves and writes every packet, producers only queue them
+    PacketQueue           mux_queue;
+    std::atomic<uint32_t> mux_wake     = 0; // bumped on every push
+    std::atomic<bool>     mux_stopping = false;
+    std::thread           mux_thread;
+
+    // segmented output, format_context only serves as the template of the segments
+    // touched by the mux thread only
+    std::unique_ptr<Segment>   segment;
+    int                        segment_number     = 0;
+    int                        segment_cut_stream = -1; // cut at its keyframes, or anywhere when there is no video
+    std::deque<SegmentHistory> segment_history;         // oldest first
+    std::thread                finalizer;               // writes the trailer of the previous segment
+    bool                       cut_overdue     = false; // the limit passed before a keyframe, one was asked for
+    std::atomic<bool>          keyframe_wanted = false; // set by the mux thread, taken by the producer
+
+    enum class OutputRequest {
+        None,
+        Requested,
+        Started,
+        Failed,
+    };
+
+    // pre-roll, also done on the template streams
+    std::atomic<bool>          output_started = false; // otherwise packets go to preroll
+    std::atomic<OutputRequest> output_request = OutputRequest::None;
+    std::deque<PooledPacket>   preroll; // mux thread only, in write order, starts at a keyframe once trimmed
+    int64_t                    preroll_bytes = 0;
 
-    auto create_video_filter(const VideoParamsInternal& params, InternalVideoContext::HWBuffers& hw_bufs, AVCodecContext& codec_context) -> std::optional<VideoFilter>;
+    auto create_video_filter(const VideoParamsInternal& params, AVCodecContext& codec_context) -> std::optional<VideoFilter>;
     auto setup_crop_bsf(const VideoParamsExternal& params, const char* bsf_name, AVStream& stream) -> std::optional<AutoAVBSFContext>;
+    auto setup_dht_bsf(AVStream& stream) -> std::optional<AutoAVBSFContext>;
     auto init_video_stream_internal(const VideoParamsInternal& params) -> std::optional<InternalVideoContext>;
     auto init_video_stream_external(const VideoParamsExternal& params) -> std::optional<ExternalVideoContext>;
     auto init_audio_stream_internal(const AudioParamsInternal& params) -> std::optional<InternalAudioContext>;
     auto init_codecs() -> bool;
-    auto encode(AVFrame* frame, AVPacket* packet, bool video) -> bool;
-    auto push_frame(AutoAVFrame frame, int usec) -> bool;
+    auto write_header(AVFormatContext& ctx) -> bool;
+    auto is_segmented() const -> bool;
+    auto uses_template() const -> bool;
+    auto is_deferred() const -> bool;
+    auto open_segment(int64_t start_us) -> bool;
+    auto is_cut_point(const AVPacket& packet) const -> bool;
+    auto write_packet(AVPacket* packet) -> bool;
+    auto hold_preroll(PooledPacket packet) -> void;
+    auto flush_preroll() -> bool;
+    auto encode(AVFrame* frame, bool video) -> bool;
+    auto push_frame(InternalVideoContext& ctx, int usec) -> bool;
 
+    // moves the packet to the mux thread
     auto mux_packet(AVPacket* packet, AVStream* stream, AVRational src_tb) -> bool;
+    auto mux_main() -> void;
     auto ensure_header(std::span<const uint8_t> annexb) -> bool;
 
   public:
     auto init(EncoderParams params) -> bool;
     auto add_frame(std::span<const Plane> planes, int usec) -> bool;
-    auto add_video_packet(const std::byte* data, size_t size, int64_t pts_us, bool keyframe) -> bool;
+    // with free, data is referenced instead of copied and free(opaque, data) is called once the muxer is done with it
+    // free is called on failure too
+    auto add_video_packet(const std::byte* data, size_t size, int64_t pts_us, bool keyframe, BufferFree free = nullptr, void* opaque = nullptr) -> bool;
+    // deferred output only, splices the held packets into path at their oldest keyframe and keeps writing there
+    // only queues the request, the mux thread opens the file
+    auto start_output(std::string path) -> bool;
     auto is_header_written() const -> bool;
+    // the output could not be written, the rest is dropped and the add_*() functions fail
+    auto has_failed() const -> bool;
+    // a segment is due but the video has not reached a keyframe to cut at
+    // callers of add_video_packet() should have their encoder emit one, add_frame() does it by itself
+    auto take_keyframe_request() -> bool;
     auto get_audio_samples_per_push() const -> size_t;
     auto add_audio(AVFrame* frame) -> bool;
     auto add_audio(std::span<const std::byte* const> buffers) -> bool;
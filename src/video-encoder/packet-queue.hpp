@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <memory>
+
+#include "common.hpp"
+
+namespace ff {
+// bounded lock-free queue from any number of producer threads to one consumer thread
+// the slots own their packets, references are moved in and out so nothing is allocated after init()
+class PacketQueue {
+  private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        AutoAVPacket        packet;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t                  mask = 0;
+
+    alignas(64) std::atomic<size_t> tail = 0; // next slot to claim, shared by the producers
+    alignas(64) size_t head              = 0; // next slot to pop, consumer only
+
+  public:
+    // capacity must be a power of two
+    auto init(const size_t capacity) -> bool {
+        if(capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            return false;
+        }
+        slots.reset(new Slot[capacity]);
+        mask = capacity - 1;
+        for(auto i = 0uz; i < capacity; i += 1) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+            slots[i].packet.reset(av_packet_alloc());
+            if(!slots[i].packet) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // producer side, moves the reference out of packet, fails and leaves it untouched when full
+    auto push(AVPacket* const packet) -> bool {
+        auto pos = tail.load(std::memory_order_relaxed);
+        while(true) {
+            auto&      slot = slots[pos & mask];
+            const auto seq  = slot.seq.load(std::memory_order_acquire);
+            if(seq == pos) {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    av_packet_move_ref(slot.packet.get(), packet);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(seq < pos) {
+                return false; // the consumer has not freed this slot yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer side, a false result stays valid until the next pop()
+    auto empty() const -> bool {
+        return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1;
+    }
+
+    // consumer side, moves the oldest packet into packet
+    auto pop(AVPacket* const packet) -> bool {
+        auto& slot = slots[head & mask];
+        if(slot.seq.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        av_packet_move_ref(packet, slot.packet.get());
+        slot.seq.store(head + mask + 1, std::memory_order_release);
+        head += 1;
+        return true;
+    }
+};
+} // namespace ff
@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.hpp"
+
+namespace ff {
+// steady-state recording should only bump acquired
+struct PoolStats {
+    std::atomic<size_t> allocated = 0; // trips to the allocator
+    std::atomic<size_t> acquired  = 0; // objects handed out
+};
+
+// recycles blank objects, a released one is unreferenced and kept for the next acquire()
+template <class T, auto alloc, auto unref, class Auto>
+class Pool {
+  private:
+    std::mutex        lock;
+    std::vector<Auto> blanks;
+
+    auto release(T* const ptr) -> void {
+        unref(ptr);
+        const auto guard = std::lock_guard(lock);
+        blanks.emplace_back(ptr);
+    }
+
+  public:
+    struct Deleter {
+        Pool* pool = nullptr;
+
+        auto operator()(T* const ptr) -> void {
+            pool->release(ptr);
+        }
+    };
+
+    using Pooled = std::unique_ptr<T, Deleter>;
+
+    PoolStats stats;
+
+    // null when out of memory
+    auto acquire() -> Pooled {
+        stats.acquired += 1;
+        {
+            const auto guard = std::lock_guard(lock);
+            if(!blanks.empty()) {
+                const auto ptr = blanks.back().release();
+                blanks.pop_back();
+                return Pooled(ptr, Deleter{this});
+            }
+        }
+        stats.allocated += 1;
+        return Pooled(alloc(), Deleter{this});
+    }
+};
+
+using FramePool    = Pool<AVFrame, av_frame_alloc, av_frame_unref, AutoAVFrame>;
+using PacketPool   = Pool<AVPacket, av_packet_alloc, av_packet_unref, AutoAVPacket>;
+using PooledFrame  = FramePool::Pooled;
+using PooledPacket = PacketPool::Pooled;
+
+// shared by every encoder and converter in the process
+inline auto frame_pool() -> FramePool& {
+    static auto pool = FramePool();
+    return pool;
+}
+
+inline auto packet_pool() -> PacketPool& {
+    static auto pool = PacketPool();
+    return pool;
+}
+} // namespace ff
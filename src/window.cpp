@@ -111,6 +111,17 @@ struct TakeButton : Button {
         return window->movie ? "Record" : "Take";
     }
 
+    auto on_held(const bool held) -> void override {
+        if(window->movie) {
+            return;
+        }
+        // shoot on press, bursts may last while held
+        window->context.shutter_held = held;
+        if(held) {
+            window->context.camera_command = Command::TakePhoto;
+        }
+    }
+
     auto on_pressed() -> void override {
         if(window->movie) {
             if(window->recording) {
@@ -120,8 +131,7 @@ struct TakeButton : Button {
                 window->context.camera_command = Command::StartRecording;
             }
         } else {
-            window->context.camera_command = Command::TakePhoto;
-            pressed                        = false;
+            pressed = false;
         }
     }
 };
@@ -134,8 +144,9 @@ struct ModeButton : Button {
     }
 
     auto on_pressed() -> void override {
-        window->movie = !window->movie;
-        pressed       = false;
+        window->movie         = !window->movie;
+        window->context.movie = window->movie;
+        pressed               = false;
     }
 
     auto is_active() -> bool override {
@@ -192,6 +203,7 @@ auto WindowCallbacks::draw_button(const gawl::Point& base, const std::string_vie
 auto WindowCallbacks::refresh() -> void {
     // proc command
     constexpr auto shutter_anim_duration = 10;
+    constexpr auto failed_anim_duration  = 180;
     switch(std::exchange(context.ui_command, Command::None)) {
     case Command::TakePhotoDone:
         shutter_anim = shutter_anim_duration;
@@ -203,6 +215,11 @@ auto WindowCallbacks::refresh() -> void {
     case Command::StopRecordingDone:
         recording = false;
         break;
+    case Command::RecordingFailed:
+        recording            = false;
+        take_button->pressed = false;
+        failed_anim          = failed_anim_duration;
+        break;
     default:
         break;
     }
@@ -238,6 +255,10 @@ auto WindowCallbacks::refresh() -> void {
         const auto str = std::format("{:02d}:{:02d}.{:03d}", min, sec % 60, ms % 1000);
         font.draw_fit_rect(*window, preview_rect, colors::palette_white, str, {.align_x = gawl::Align::Right, .align_y = gawl::Align::Right});
     }
+    if(failed_anim > 0) {
+        font.draw_fit_rect(*window, preview_rect, colors::palette_white, "recording failed", {.align_x = gawl::Align::Left, .align_y = gawl::Align::Right});
+        failed_anim -= 1;
+    }
 
     // fps
     font.draw_fit_rect(*window, preview_rect, colors::palette_white, std::format("{}/{}", render_rate, context.capture_rate), {.align_x = gawl::Align::Right, .align_y = gawl::Align::Left});
@@ -317,6 +338,7 @@ auto WindowCallbacks::on_pointer(const gawl::Point pos) -> coop::Async<bool> {
         const auto rect   = gawl::Rectangle{button.displayed_pos, button.displayed_pos + button_size};
         if(!in_rect(rect, cursor)) {
             button.pressed = false;
+            button.on_held(false);
             pressed.reset();
         }
     } break;
@@ -356,6 +378,7 @@ auto WindowCallbacks::on_click(const uint32_t button, const gawl::ButtonState st
         switch(pressed.get_index()) {
         case Pressed::index_of<PressedButton>: {
             auto& button = *pressed.as<PressedButton>().button;
+            button.on_held(false);
             if(state == gawl::ButtonState::Release) {
                 button.on_pressed();
             }
@@ -380,6 +403,7 @@ auto WindowCallbacks::on_click(const uint32_t button, const gawl::ButtonState st
         if(in_rect(rect, cursor) && (button->is_active() || button->pressed)) {
             pressed.emplace<PressedButton>(button.get());
             button->pressed = true;
+            button->on_held(true);
             co_return true;
         }
         switch(button->expand.get_index()) {
@@ -420,6 +444,7 @@ auto WindowCallbacks::get_context() -> WindowContext& {
 WindowCallbacks::WindowCallbacks() {
     auto take    = new TakeButton();
     take->window = this;
+    take_button  = take;
     buttons.emplace_back(take);
 
     auto mode    = new ModeButton();
@@ -14,6 +14,7 @@ enum class Command {
     StartRecordingDone,
     StopRecording,
     StopRecordingDone,
+    RecordingFailed, // the camera stopped the recording by itself
 };
 
 struct WindowContext {
@@ -21,6 +22,10 @@ struct WindowContext {
     Command                ui_command;     // camera -> ui
     Command                camera_command; // ui -> camera
     int                    capture_rate = 0;
+    // ui -> camera, keeps an encoder on standby
+    bool movie = false;
+    // ui -> camera, a burst of --burst 0 lasts while this is set
+    bool shutter_held = false;
 };
 
 struct PressedButton {
@@ -52,6 +57,8 @@ class WindowCallbacks : public gawl::WindowNoTouchCallbacks {
     FPSCounter                           render_counter;
     int                                  render_rate  = 0;
     int                                  shutter_anim = 0;
+    int                                  failed_anim  = 0;
+    Button*                              take_button  = nullptr;
     bool                                 movie        = false;
     bool                                 recording    = false;
 